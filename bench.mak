@@ -0,0 +1,11 @@
+SRC_FILES=src/chip8.c src/chip8jit.c src/sdl2/system.c src/bench/*.c
+HEADER_FILES=src/*.h src/sdl2/*.h
+
+CC=gcc
+CFLAGS=-std=gnu99 -Wall -O2 -Isrc/ -Isrc/sdl2 $(shell sdl2-config --cflags) -DPLATFORM_SDL2
+
+
+all: $(SRC_FILES) $(HEADER_FILES)
+	@mkdir -p bench
+	$(CC) $(CFLAGS) $(SRC_FILES) -o bench/pschip8 $(shell sdl2-config --libs) -lSDL2_mixer -lm
+
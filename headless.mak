@@ -0,0 +1,35 @@
+SRC_FILES=src/chip8.c src/chip8jit.c src/movie.c src/headless/*.c
+HEADER_FILES=src/*.h src/headless/*.h
+
+CC=gcc
+CFLAGS=-std=gnu99 -Wall -O2 -Isrc/ -Isrc/headless -DPLATFORM_HEADLESS -pthread
+
+# make PROFILE=1 counts the executed opcodes, see chip8.h
+ifdef PROFILE
+CFLAGS+=-DCHIP8_PROFILE
+endif
+
+
+all: $(SRC_FILES) $(HEADER_FILES)
+	@mkdir -p headless
+	$(CC) $(CFLAGS) $(SRC_FILES) -o headless/pschip8 -pthread
+
+
+# every rom replays its check/movies input, the frames hashed every 5 s
+# must match check/golden with each engine. the executed/s of each is
+# compared against check/baseline.ENGINE, which only gets reported
+CHECK_ENGINES=interp predecode threaded jit
+CHECK_FLAGS=-v 1 -n 153600 -f 300 $(addprefix -p ,$(wildcard check/movies/*.C8M))
+
+check: all
+	@set -e; for e in $(CHECK_ENGINES); do \
+		./headless/pschip8 $(CHECK_FLAGS) -e $$e -c check/golden -b check/baseline.$$e; \
+	done
+
+# rewrites them, every engine hashes the same frames
+golden: all
+	@set -e; for e in $(CHECK_ENGINES); do \
+		./headless/pschip8 $(CHECK_FLAGS) -e $$e -w check/golden -b check/baseline.$$e; \
+	done
+
+.PHONY: all check golden
@@ -4,6 +4,11 @@ HEADER_FIELS=src/*.h src/sdl2/*.h
 CC=gcc
 CFLAGS=-std=gnu99 -Wall -O0 -g -Isrc/ -Isrc/sdl2 $(shell sdl2-config --cflags) -DPLATFORM_SDL2 -fsanitize=address
 
+# make PROFILE=1 counts the executed opcodes, see chip8.h
+ifdef PROFILE
+CFLAGS+=-DCHIP8_PROFILE
+endif
+
 
 all: $(SRC_FILES) $(HEADER_FILES)
 	$(CC) $(CFLAGS) $(SRC_FILES) -o sdl2/pschip8 $(shell sdl2-config --libs) -lSDL2_mixer
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "system.h"
+#include "chip8.h"
+
+
+#define SAMPLES      (15)
+#define SAMPLE_NSEC  (5000000ull)
+#define BLOCK_BUDGET (CHIP8_FREQ)
+
+struct bench {
+	const char* name;
+	void (*run)(struct bench* b, long iters);
+	uint16_t opcode;
+	uint8_t x, y;      /* Vx, Vy for the draw positions */
+	uint8_t n;         /* sprite height, dirty rows */
+	bool hires;        /* runs in the 128x64 mode */
+	const uint16_t* code; /* the loop of a block bench, 0 terminated */
+};
+
+
+static struct chip8* vm;
+static __typeof__(vm->rgs) step_rgs;
+static chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH];
+static enum Chip8Engine engine = CHIP8ENGINE_INTERP;
+
+static const char* const engine_names[] = {
+	[CHIP8ENGINE_INTERP]    = "interp",
+	[CHIP8ENGINE_PREDECODE] = "predecode",
+	[CHIP8ENGINE_THREADED]  = "threaded",
+	[CHIP8ENGINE_JIT]       = "jit"
+};
+
+
+/* the opcode under test sits at 0x200 and every step starts over
+ * from the same registers, so the timings are of that opcode alone
+ */
+static void setup_step(const struct bench* const b)
+{
+	chip8_reset(vm);
+	vm->ram[0x200] = b->opcode>>8;
+	vm->ram[0x201] = b->opcode&0xFF;
+	chip8_set_engine(vm, engine);
+	memset(&vm->ram[0x300], 0xFF, 0x20);
+	vm->rgs.i = 0x300;
+	vm->rgs.v[0] = b->x;
+	vm->rgs.v[1] = b->y;
+	vm->rgs.v[2] = 0x0A;
+	vm->rgs.dt = 0xFF;
+	vm->stack[15] = 0x202;
+	/* 00EE needs something to return to */
+	if (b->opcode == 0x00EE)
+		vm->rgs.sp = 14;
+	step_rgs = vm->rgs;
+}
+
+static void run_step(struct bench* const b, long iters)
+{
+	while (iters-- > 0) {
+		vm->rgs = step_rgs;
+		chip8_step(vm);
+	}
+}
+
+static void run_step_lit(struct bench* const b, long iters)
+{
+	while (iters-- > 0) {
+		memset(vm->gfx, 0xFF, sizeof vm->gfx);
+		vm->rgs = step_rgs;
+		chip8_step(vm);
+	}
+}
+
+/* the loop is loaded at 0x200 and run through chip8_run() with a
+ * real budget, so the block engines run it from their caches
+ */
+static void setup_block(const struct bench* const b)
+{
+	uint8_t code[0x40];
+	short size = 0;
+
+	chip8_reset(vm);
+	chip8_set_engine(vm, engine);
+	for (; b->code[size / 2] != 0; size += 2) {
+		code[size] = b->code[size / 2]>>8;
+		code[size + 1] = b->code[size / 2]&0xFF;
+	}
+	chip8_loadrom_raw(vm, code, size);
+}
+
+/* one op is one instruction of the loop */
+static void run_block(struct bench* const b, long iters)
+{
+	while (iters > 0)
+		iters -= chip8_run(vm, iters < BLOCK_BUDGET ? iters : BLOCK_BUDGET, NULL);
+}
+
+static void run_render(struct bench* const b, long iters)
+{
+	const uint32_t dirty = b->n == 32 ? CHIP8_DIRTY_ALL : (0x01ul<<b->n) - 1;
+	while (iters-- > 0) {
+		vm->dirty_rows = dirty;
+		chip8_render(vm, pixels);
+	}
+}
+
+#if defined(PLATFORM_SDL2)
+static void run_font_print(struct bench* const b, long iters)
+{
+	static int fps = 60;
+	static int steps = 512;
+	const void* const varpack[] = { &fps, &steps };
+	const struct vec2 pos = { 8, 8 };
+	while (iters-- > 0) {
+		font_print(&pos, b->n ? "Frames per second: %d\nSteps per second: %d"
+		                      : "Frames per second: 60\nSteps per second: 512",
+		           varpack);
+	}
+}
+
+static void run_load_ram_buffer(struct bench* const b, long iters)
+{
+	const struct vec2 pos = { (SCREEN_WIDTH / 2), (SCREEN_HEIGHT / 2) };
+	const struct vec2 size = { CHIP8_GFX_WIDTH, CHIP8_GFX_HEIGHT };
+	while (iters-- > 0)
+		load_ram_buffer(pixels, &pos, &size, 3);
+}
+
+static void run_load_ram_buffer_rows(struct bench* const b, long iters)
+{
+	while (iters-- > 0)
+		load_ram_buffer_rows(pixels, 1, b->n);
+}
+#endif
+
+static double time_iters(struct bench* const b, const long iters)
+{
+	const uint64_t start = get_nsec_now();
+	b->run(b, iters);
+	return get_nsec_now() - start;
+}
+
+/* grows the iterations until a sample takes SAMPLE_NSEC, which is also
+ * the warm up, then reports the ns/op mean, deviation and minimum
+ */
+static void run_bench(struct bench* const b)
+{
+	double samples[SAMPLES];
+	double mean = 0, var = 0, min;
+	long iters = 1;
+	int i;
+
+	if (b->run == run_step || b->run == run_step_lit)
+		setup_step(b);
+	else if (b->run == run_block)
+		setup_block(b);
+	vm->hires = b->hires;
+
+	while (time_iters(b, iters) < SAMPLE_NSEC)
+		iters *= 2;
+
+	for (i = 0; i < SAMPLES; ++i) {
+		samples[i] = time_iters(b, iters) / iters;
+		mean += samples[i];
+	}
+	mean /= SAMPLES;
+
+	min = samples[0];
+	for (i = 0; i < SAMPLES; ++i) {
+		var += (samples[i] - mean) * (samples[i] - mean);
+		if (samples[i] < min)
+			min = samples[i];
+	}
+	var /= SAMPLES - 1;
+
+	printf("%-32s %10.2f ns/op  +- %6.2f  min %10.2f%s\n",
+	       b->name, mean, sqrt(var), min,
+	       vm->state == CHIP8STATE_HALTED ? "  (halted)" : "");
+}
+
+
+static const uint16_t alu_loop[] = {
+	0x7001, /* add v0, 1 */
+	0x8104, /* add v1, v0 */
+	0x8216, /* shr v2 */
+	0x8314, /* add v3, v1 */
+	0x4000, /* sne v0, 0 */
+	0x7401, /* add v4, 1 */
+	0x1200, /* jp 0x200 */
+	0
+};
+
+/* a score counter, like most games redraw */
+static const uint16_t draw_loop[] = {
+	0x7501, /* add v5, 1 */
+	0xF529, /* ld f, v5 */
+	0xD015, /* drw v0, v1, 5 */
+	0xA400, /* ld i, 0x400 */
+	0xF533, /* ld b, v5 */
+	0xF265, /* ld v2, [i] */
+	0x1200, /* jp 0x200 */
+	0
+};
+
+static const uint16_t call_loop[] = {
+	0x2206, /* call 0x206 */
+	0x7001, /* add v0, 1 */
+	0x1200, /* jp 0x200 */
+	0x8104, /* add v1, v0 */
+	0x00EE, /* ret */
+	0
+};
+
+static struct bench benches[] = {
+	{ "step 6xkk ld",           run_step, 0x6012 },
+	{ "step 7xkk add",          run_step, 0x7012 },
+	{ "step 8xy4 add carry",    run_step, 0x8014 },
+	{ "step 8xy6 shr",          run_step, 0x8016 },
+	{ "step 3xkk se",           run_step, 0x3212 },
+	{ "step 5xy0 se",           run_step, 0x5010 },
+	{ "step 1nnn jp",           run_step, 0x1300 },
+	{ "step 2nnn call",         run_step, 0x2300 },
+	{ "step 00EE ret",          run_step, 0x00EE },
+	{ "step Bnnn jp v0",        run_step, 0xB300 },
+	{ "step Annn ld i",         run_step, 0xA300 },
+	{ "step Fx1E add i",        run_step, 0xF21E },
+	{ "step Cxkk rnd",          run_step, 0xC2FF },
+	{ "step Ex9E skp",          run_step, 0xE29E },
+	{ "step Fx07 ld dt",        run_step, 0xF207 },
+	{ "step Fx15 ld dt",        run_step, 0xF215 },
+	{ "step Fx29 ld f",         run_step, 0xF229 },
+	{ "step Fx33 bcd",          run_step, 0xF233 },
+	{ "step Fx55 store 16",     run_step, 0xFF55 },
+	{ "step Fx65 load 16",      run_step, 0xFF65 },
+	{ "step 00E0 cls blank",    run_step, 0x00E0 },
+	{ "step 00E0 cls lit",      run_step_lit, 0x00E0 },
+	{ "step Dxyn draw 1 at 0,0",   run_step, 0xD011, 0, 0 },
+	{ "step Dxyn draw 5 at 0,0",   run_step, 0xD015, 0, 0 },
+	{ "step Dxyn draw 15 at 0,0",  run_step, 0xD01F, 0, 0 },
+	{ "step Dxyn draw 5 at 13,7",  run_step, 0xD015, 13, 7 },
+	{ "step Dxyn draw 15 at 13,7", run_step, 0xD01F, 13, 7 },
+	{ "step Dxyn draw 5 wrap x",   run_step, 0xD015, 60, 7 },
+	{ "step Dxyn draw 15 wrap xy", run_step, 0xD01F, 60, 24 },
+	{ "step Dxy0 draw 16x16 at 13,7", run_step, 0xD010, 13, 7 },
+	{ "step 00C4 scroll down lit",    run_step_lit, 0x00C4 },
+	{ "step 00FB scroll right lit",   run_step_lit, 0x00FB },
+	{ "step 00FC scroll left lit",    run_step_lit, 0x00FC },
+	{ "hires Dxyn draw 15 at 13,7",   run_step, 0xD01F, 13, 7, 0, true },
+	{ "hires Dxyn draw 15 wrap xy",   run_step, 0xD01F, 124, 56, 0, true },
+	{ "hires Dxy0 draw 16x16 at 13,7",  run_step, 0xD010, 13, 7, 0, true },
+	{ "hires Dxy0 draw 16x16 wrap xy",  run_step, 0xD010, 120, 56, 0, true },
+	{ "hires 00E0 cls lit",           run_step_lit, 0x00E0, 0, 0, 0, true },
+	{ "hires 00C4 scroll down lit",   run_step_lit, 0x00C4, 0, 0, 0, true },
+	{ "hires 00FB scroll right lit",  run_step_lit, 0x00FB, 0, 0, 0, true },
+	{ "hires 00FC scroll left lit",   run_step_lit, 0x00FC, 0, 0, 0, true },
+	{ "block alu loop",         run_block, 0, 0, 0, 0, false, alu_loop },
+	{ "block draw loop",        run_block, 0, 0, 0, 0, false, draw_loop },
+	{ "block call loop",        run_block, 0, 0, 0, 0, false, call_loop },
+	{ "render 1 row",           run_render, 0, 0, 0, 1 },
+	{ "render 8 rows",          run_render, 0, 0, 0, 8 },
+	{ "render all rows",        run_render, 0, 0, 0, 32 },
+	{ "hires render all rows",  run_render, 0, 0, 0, 32, true },
+	#if defined(PLATFORM_SDL2)
+	{ "font_print plain",       run_font_print, 0, 0, 0, 0 },
+	{ "font_print format",      run_font_print, 0, 0, 0, 1 },
+	{ "load_ram_buffer",        run_load_ram_buffer },
+	{ "load_ram_buffer_rows 1",  run_load_ram_buffer_rows, 0, 0, 0, 1 },
+	{ "load_ram_buffer_rows 32", run_load_ram_buffer_rows, 0, 0, 0, 32 },
+	#endif
+};
+
+
+static void usage(const char* const prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-e interp|predecode|threaded|jit] [bench...]\n"
+	        "  runs the benches whose name starts with any of the arguments,\n"
+	        "  all of them by default. the step and hires benches run one\n"
+	        "  instruction per chip8_run(), which always interprets it, only\n"
+	        "  the block benches time the -e engine\n",
+	        prog);
+	exit(EXIT_FAILURE);
+}
+
+static enum Chip8Engine parse_engine(const char* const name,
+                                     const char* const prog)
+{
+	for (size_t i = 0; i < sizeof(engine_names)/sizeof(engine_names[0]); ++i) {
+		if (strcmp(name, engine_names[i]) == 0)
+			return i;
+	}
+
+	usage(prog);
+	return CHIP8ENGINE_INTERP;
+}
+
+static bool selected(const struct bench* const b, char** const names, const int nnames)
+{
+	if (nnames == 0)
+		return true;
+
+	for (int i = 0; i < nnames; ++i) {
+		if (strncmp(b->name, names[i], strlen(names[i])) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+int main(int argc, char** argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:h")) != -1) {
+		switch (opt) {
+		case 'e': engine = parse_engine(optarg, argv[0]); break;
+		default: usage(argv[0]); break;
+		}
+	}
+
+	#if defined(PLATFORM_SDL2)
+	{
+		/* no window or sound device needed to time the platform code */
+		const char* const fontpath = "FONT3.BMP";
+		void* font = NULL;
+		SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+		SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+		init_system();
+		load_files(&fontpath, &font, 1);
+		load_font(font, &(struct vec2){6, 8}, 32, 256);
+		FREE(font);
+	}
+	#endif
+
+	vm = chip8_create();
+	chip8_render(vm, pixels);
+
+	printf("%s engine, %d samples of at least %llu ms\n\n",
+	       engine_names[engine], SAMPLES, SAMPLE_NSEC / 1000000ull);
+
+	for (size_t i = 0; i < sizeof(benches)/sizeof(benches[0]); ++i) {
+		if (selected(&benches[i], &argv[optind], argc - optind))
+			run_bench(&benches[i]);
+	}
+
+	chip8_destroy(vm);
+
+	#if defined(PLATFORM_SDL2)
+	term_system();
+	#endif
+
+	return EXIT_SUCCESS;
+}
@@ -1,24 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "chip8.h"
+#include "chip8jit.h"
 
 
-chip8_gfx_t chip8_gfx[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH];
-chip8_key_t chip8_keys;
-bool chip8_draw_flag;
-
-
-static struct {
-	uint16_t pc;
-	uint16_t i;
-	int8_t   sp;
-	uint8_t  v[0x10];
-	uint8_t  dt;
-	uint8_t  st;
-} rgs;
-
-static uint8_t ram[0x1000];
-static uint16_t stack[16];
+/* the guest's I relative accesses wrap around the 4 KB of ram */
+#define RAM_ADDR(addr) ((addr)&0x0FFF)
 
 static const uint8_t font[80] = {
 	0xF0, 0x90, 0x90, 0x90, 0xF0, /* 0 */
@@ -39,256 +26,685 @@ static const uint8_t font[80] = {
 	0xF0, 0x80, 0xF0, 0x80, 0x80  /* F */
 };
 
+/* SUPER-CHIP's 8x10 digits for Fx30, right after font in ram */
+static const uint8_t big_font[100] = {
+	0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, /* 0 */
+	0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, /* 1 */
+	0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, /* 2 */
+	0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, /* 3 */
+	0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, /* 4 */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, /* 5 */
+	0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, /* 6 */
+	0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, /* 7 */
+	0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, /* 8 */
+	0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C  /* 9 */
+};
+
+
+/* predecoded instruction, one per ram address */
+struct chip8_op {
+	uint8_t handler;
+	uint8_t x;
+	uint8_t y;
+	uint8_t kk;
+	uint16_t nnn;
+};
+
+enum OpHandler {
+	OP_UNDECODED,
+	OP_CLS,
+	OP_RET,
+	OP_JP,
+	OP_CALL,
+	OP_SE_VX_KK,
+	OP_SNE_VX_KK,
+	OP_SE_VX_VY,
+	OP_LD_VX_KK,
+	OP_ADD_VX_KK,
+	OP_LD_VX_VY,
+	OP_OR_VX_VY,
+	OP_AND_VX_VY,
+	OP_XOR_VX_VY,
+	OP_ADD_VX_VY,
+	OP_SUB_VX_VY,
+	OP_SHR_VX,
+	OP_SUBN_VX_VY,
+	OP_SHL_VX,
+	OP_SNE_VX_VY,
+	OP_LD_I_NNN,
+	OP_JP_V0_NNN,
+	OP_RND_VX_KK,
+	OP_DRW_VX_VY_N,
+	OP_SKP_VX,
+	OP_SKNP_VX,
+	OP_LD_VX_DT,
+	OP_LD_VX_K,
+	OP_LD_DT_VX,
+	OP_LD_ST_VX,
+	OP_ADD_I_VX,
+	OP_LD_F_VX,
+	OP_LD_B_VX,
+	OP_LD_MI_VX,
+	OP_LD_VX_MI,
+	OP_SCD_N,
+	OP_SCR,
+	OP_SCL,
+	OP_LOW,
+	OP_HIGH,
+	OP_LD_HF_VX,
+	OP_LD_R_VX,
+	OP_LD_VX_R,
+	OP_NOP,
+	OP_UNKNOWN
+};
+
+#ifdef CHIP8_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_TICKS() __rdtsc()
+#else
+#define PROFILE_TICKS() get_nsec_now()
+#endif
+
+/* the class of a handler is its OpHandler - 1 */
+const char* const chip8_opclass_names[CHIP8_OPCLASSES] = {
+	"00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk",
+	"7xkk", "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6",
+	"8xy7", "8xyE", "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E",
+	"ExA1", "Fx07", "Fx0A", "Fx15", "Fx18", "Fx1E", "Fx29", "Fx33",
+	"Fx55", "Fx65", "00Cn", "00FB", "00FC", "00FE", "00FF", "Fx30",
+	"Fx75", "Fx85", "Ex??", "????"
+};
+#endif
+
+/* profiling counts single instructions, so no block engines */
+#if defined(__GNUC__) && !defined(CHIP8_PROFILE)
+#define CHIP8_HAVE_THREADED
+
+#define BLOCK_MAX_INSTRS  (32)
+#define BLOCK_CACHE_SIZE  (256)
+
+/* direct threaded instruction, label is the handler's address
+ * inside execute_threaded()
+ */
+struct chip8_tinstr {
+	const void* label;
+	uint8_t x;
+	uint8_t y;
+	uint8_t kk;
+	uint16_t nnn;
+};
+
+struct chip8_block {
+	uint16_t start;   /* address of the first instruction */
+	uint16_t end;     /* address after the last instruction */
+	uint8_t ninstrs;
+	struct chip8_tinstr code[BLOCK_MAX_INSTRS + 1];
+};
+
+/* translated blocks keyed by start pc, code_map marks ram bytes
+ * which are part of some translated block
+ */
+struct chip8_blocks {
+	struct chip8_block* map[0x1000];
+	uint8_t code_map[0x1000];
+	int16_t used;
+	struct chip8_block pool[BLOCK_CACHE_SIZE];
+};
+#endif
+
 
-static void unknown_opcode(const uint16_t opcode)
+/* halts the vm, chip8_run() reports it as CHIP8EXIT_ERROR */
+static void unknown_opcode(struct chip8* const ctx, const uint16_t opcode)
 {
-	FATALERROR("Unkown Opcode: $%.4X", opcode);
+	LOGERROR("Unkown Opcode: $%.4X", opcode);
+	ctx->state = CHIP8STATE_HALTED;
 }
 
-static void stackpush(const uint16_t value)
+/* stack faults halt the vm like unknown opcodes do */
+static void stackpush(struct chip8* const ctx, const uint16_t value)
 {
-	ASSERT_MSG(rgs.sp >= 0, "Chip8 Stack Underflow");
-	stack[rgs.sp--] = value;
+	if (ctx->rgs.sp < 0) {
+		LOGERROR("Chip8 Stack Overflow");
+		ctx->state = CHIP8STATE_HALTED;
+		return;
+	}
+
+	ctx->stack[ctx->rgs.sp--] = value;
 }
 
-static uint16_t stackpop(void)
+static uint16_t stackpop(struct chip8* const ctx)
 {
-	ASSERT_MSG((rgs.sp + 1) <= 15, "Chip8 Stack Overflow");
-	return stack[++rgs.sp];
+	if (ctx->rgs.sp >= 15) {
+		LOGERROR("Chip8 Stack Underflow");
+		ctx->state = CHIP8STATE_HALTED;
+		return 0;
+	}
+
+	return ctx->stack[++ctx->rgs.sp];
 }
 
-static void draw(const uint8_t vx, const uint8_t vy, const uint8_t n)
+#ifdef CHIP8_HAVE_THREADED
+static void flush_blocks(struct chip8* const ctx)
 {
-	const uint8_t* const sprite = &ram[rgs.i];
-	bool bit;
-	uint8_t i, j, x, y;
-	
-	rgs.v[0x0F] = 0;
-	for (i = 0; i < n; ++i) {
-		y = ((vy + i)&31) + ((CHIP8_GFX_HEIGHT - 32) / 2u);
-		for (j = 0; j < 8; ++j) {
-			x = ((vx + j)&63) + ((CHIP8_GFX_WIDTH - 64) / 2u);
-			bit = (sprite[i]&(0x80>>j)) != 0;
+	memset(ctx->blocks->map, 0, sizeof ctx->blocks->map);
+	memset(ctx->blocks->code_map, 0, sizeof ctx->blocks->code_map);
+	ctx->blocks->used = 0;
+}
 
-			if (chip8_gfx[y][x] == CHIP8_GFX_BGC && bit) {
-				chip8_gfx[y][x] = CHIP8_GFX_FGC;
-				chip8_draw_flag = true;
-			} else if (chip8_gfx[y][x] == CHIP8_GFX_FGC && bit) {
-				chip8_gfx[y][x] = CHIP8_GFX_BGC;
-				rgs.v[0x0F] = 0x01;
-				chip8_draw_flag = true;
-			}
-		}
+static void invalidate_blocks(struct chip8* const ctx,
+                              const uint16_t addr, const uint16_t end)
+{
+	struct chip8_blocks* const cache = ctx->blocks;
+	struct chip8_block* block;
+	uint16_t i;
+
+	for (i = addr; i < end; ++i) {
+		if (cache->code_map[i])
+			break;
+	}
+
+	if (i == end)
+		return;
+
+	/* self modifying code, drop every block overlapping the write */
+	for (i = 0; i < cache->used; ++i) {
+		block = &cache->pool[i];
+		if (block->start < end && block->end > addr &&
+		    cache->map[block->start] == block)
+			cache->map[block->start] = NULL;
 	}
 }
+#endif
 
-static void update_dt_st(void)
+/* drops the cached code covering the written range [addr, addr + size),
+ * which wraps around the end of ram like the guest's addresses do
+ */
+static void invalidate_code(struct chip8* const ctx,
+                            const uint16_t addr, uint16_t size)
 {
-	static uint32_t msec_last = 0;
-	const uint32_t msec = get_msec_now();
+	uint16_t i = addr > 0 ? addr - 1 : 0;
+	uint16_t end;
+
+	if (addr + size > 0x1000) {
+		invalidate_code(ctx, 0, addr + size - 0x1000);
+		size = 0x1000 - addr;
+	}
+	end = addr + size;
+
+	#ifdef CHIP8_HAVE_THREADED
+	if (ctx->blocks != NULL)
+		invalidate_blocks(ctx, addr, end);
+	#endif
+
+	#ifdef CHIP8_HAVE_JIT
+	if (ctx->jit != NULL)
+		chip8_jit_invalidate(ctx->jit, addr, end);
+	#endif
+
+	if (ctx->ops == NULL)
+		return;
 
-	if (rgs.dt || rgs.st) {
-		while ((msec - msec_last) >= (1000u / CHIP8_DELAY_FREQ)) {
-			msec_last += (1000u / CHIP8_DELAY_FREQ);
-			if (rgs.dt > 0)
-				--rgs.dt;
-			if (rgs.st > 0)
-				--rgs.st;
+	for (; i < end; ++i)
+		ctx->ops[i].handler = OP_UNDECODED;
+}
+
+static void store_bcd(struct chip8* const ctx, const uint8_t vx)
+{
+	ctx->ram[RAM_ADDR(ctx->rgs.i + 2)] = vx % 10;
+	ctx->ram[RAM_ADDR(ctx->rgs.i + 1)] = (vx / 10) % 10;
+	ctx->ram[RAM_ADDR(ctx->rgs.i)] = vx / 100;
+	invalidate_code(ctx, RAM_ADDR(ctx->rgs.i), 3);
+}
+
+static void store_regs(struct chip8* const ctx, const uint8_t x)
+{
+	uint8_t n;
+	for (n = 0; n <= x; ++n)
+		ctx->ram[RAM_ADDR(ctx->rgs.i + n)] = ctx->rgs.v[n];
+	invalidate_code(ctx, RAM_ADDR(ctx->rgs.i), x + 1);
+}
+
+static void load_regs(struct chip8* const ctx, const uint8_t x)
+{
+	uint8_t n;
+	for (n = 0; n <= x; ++n)
+		ctx->rgs.v[n] = ctx->ram[RAM_ADDR(ctx->rgs.i + n)];
+}
+
+/* keys are cleared so only a press made while waiting resumes the vm */
+static void wait_key(struct chip8* const ctx, const uint8_t x)
+{
+	ctx->keys = 0x0000;
+	ctx->wait_reg = x;
+	ctx->state = CHIP8STATE_WAITKEY;
+}
+
+/* Vx gets the lowest key pressed */
+static void resume_key(struct chip8* const ctx)
+{
+	uint8_t key = 0;
+
+	while (!(ctx->keys&(0x01<<key)))
+		++key;
+
+	ctx->rgs.v[ctx->wait_reg] = key;
+	ctx->state = CHIP8STATE_RUNNING;
+}
+
+static uint64_t ror64(const uint64_t bits, const uint8_t n)
+{
+	return (bits>>n)|(bits<<((64 - n)&63));
+}
+
+/* row i of the sprite at I left aligned in 64 bits, Dxy0 sprites
+ * are 16x16 with 2 bytes per row
+ */
+static uint64_t sprite_row(const struct chip8* const ctx,
+                           const uint8_t i, const bool wide)
+{
+	const uint8_t* const ram = ctx->ram;
+	const uint16_t addr = ctx->rgs.i;
+
+	if (wide) {
+		return ((uint64_t)((ram[RAM_ADDR(addr + i * 2)]<<8)|
+		                   ram[RAM_ADDR(addr + i * 2 + 1)]))<<48;
+	}
+	return ((uint64_t)ram[RAM_ADDR(addr + i)])<<56;
+}
+
+/* each sprite row is rotated into place, so the 64 pixels wrap
+ * horizontally, then XORed and checked for collision in one go
+ */
+static void draw_lores(struct chip8* const ctx,
+                       const uint8_t vx, const uint8_t vy, const uint8_t n)
+{
+	const uint8_t rows = n != 0 ? n : 16;
+	uint64_t bits, collision = 0;
+	uint8_t i, y;
+
+	for (i = 0; i < rows; ++i) {
+		bits = sprite_row(ctx, i, n == 0);
+		if (bits == 0)
+			continue;
+		y = (vy + i)&(CHIP8_LORES_HEIGHT - 1);
+		bits = ror64(bits, vx&(CHIP8_LORES_WIDTH - 1));
+		collision |= ctx->gfx[y][0]&bits;
+		ctx->gfx[y][0] ^= bits;
+		ctx->dirty_rows |= 0x01ul<<y;
+	}
+
+	ctx->rgs.v[0x0F] = collision != 0;
+}
+
+/* the same over 128 pixel rows, the sprite row is rotated across the
+ * two words so it wraps too. like SUPER-CHIP VF counts the rows
+ * which collided
+ */
+static void draw_hires(struct chip8* const ctx,
+                       const uint8_t vx, const uint8_t vy, const uint8_t n)
+{
+	const uint8_t rows = n != 0 ? n : 16;
+	const uint8_t shift = vx&63;
+	const bool swap = (vx&(CHIP8_SCR_WIDTH - 1)) >= 64;
+	uint64_t* row;
+	uint64_t bits, left, right;
+	uint8_t i, y, hits = 0;
+
+	for (i = 0; i < rows; ++i) {
+		bits = sprite_row(ctx, i, n == 0);
+		if (bits == 0)
+			continue;
+		y = (vy + i)&(CHIP8_SCR_HEIGHT - 1);
+		left = bits>>shift;
+		right = shift != 0 ? bits<<(64 - shift) : 0;
+		if (swap) {
+			bits = left;
+			left = right;
+			right = bits;
 		}
-	} else {
-		msec_last = msec;
+		row = ctx->gfx[y];
+		hits += ((row[0]&left)|(row[1]&right)) != 0;
+		row[0] ^= left;
+		row[1] ^= right;
+		ctx->dirty_rows |= 0x01ul<<(y>>1);
 	}
+
+	ctx->rgs.v[0x0F] = hits;
 }
 
-static void clear_gfx(void)
+static void draw(struct chip8* const ctx,
+                 const uint8_t vx, const uint8_t vy, const uint8_t n)
 {
-	int i, j;
-	for (i = 0; i < CHIP8_GFX_HEIGHT; ++i)
-		for (j = 0; j < CHIP8_GFX_WIDTH; ++j)
-			chip8_gfx[i][j] = CHIP8_GFX_BGC;
+	if (ctx->hires)
+		draw_hires(ctx, vx, vy, n);
+	else
+		draw_lores(ctx, vx, vy, n);
 }
 
+/* sets row y of the display, damaging it only when it changes */
+static void set_row(struct chip8* const ctx, const uint8_t y,
+                    const uint64_t left, const uint64_t right)
+{
+	uint64_t* const row = ctx->gfx[y];
 
-void chip8_loadrom(const char* const fname)
+	if (row[0] == left && row[1] == right)
+		return;
+
+	row[0] = left;
+	row[1] = right;
+	ctx->dirty_rows |= 0x01ul<<(ctx->hires ? y>>1 : y);
+}
+
+/* 00Cn, whole rows move down and the ones pushed out are lost.
+ * in lores it scrolls lores rows, as modern SUPER-CHIPs do
+ */
+static void scroll_down(struct chip8* const ctx, const uint8_t n)
 {
-	void* p = &ram[0x200];
-	load_files(&fname, &p, 1);
+	const uint8_t height = ctx->hires ? CHIP8_SCR_HEIGHT : CHIP8_LORES_HEIGHT;
+	uint8_t y;
+
+	for (y = height; y-- > 0;) {
+		if (y >= n)
+			set_row(ctx, y, ctx->gfx[y - n][0], ctx->gfx[y - n][1]);
+		else
+			set_row(ctx, y, 0, 0);
+	}
+}
+
+/* 00FB and 00FC move the display 4 pixels, shifting both words of
+ * a row at once. lores rows have no right word
+ */
+static void scroll_side(struct chip8* const ctx, const bool left)
+{
+	const uint8_t height = ctx->hires ? CHIP8_SCR_HEIGHT : CHIP8_LORES_HEIGHT;
+	const uint64_t* row;
+	uint64_t l, r;
+	uint8_t y;
+
+	for (y = 0; y < height; ++y) {
+		row = ctx->gfx[y];
+		if ((row[0]|row[1]) == 0)
+			continue;
+		if (left) {
+			l = (row[0]<<4)|(row[1]>>60);
+			r = row[1]<<4;
+		} else {
+			l = row[0]>>4;
+			r = (row[1]>>4)|(row[0]<<60);
+		}
+		set_row(ctx, y, l, ctx->hires ? r : 0);
+	}
+}
+/* spreads the seed bits over the whole state, xorshift can't leave 0 */
+static uint32_t seed_state(uint32_t seed)
+{
+	seed ^= seed >> 16;
+	seed *= 0x85EBCA6Bul;
+	seed ^= seed >> 13;
+	seed *= 0xC2B2AE35ul;
+	seed ^= seed >> 16;
+	return seed != 0 ? seed : 0x9E3779B9ul;
 }
 
-void chip8_loadrom_raw(const void* data, const short size)
+/* xorshift32, the high byte is the best mixed one */
+static uint8_t next_random(struct chip8* const ctx)
 {
-	memcpy(&ram[0x200], data, size);
+	uint32_t x = ctx->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	ctx->rng = x;
+	return x >> 24;
 }
 
-void chip8_reset(void)
+static void log_beep(struct chip8* const ctx, const uint32_t cycle, const bool on)
 {
-	memset(&rgs, 0, sizeof rgs);
-	memset(stack, 0, sizeof stack);
-	memcpy(ram, font, sizeof font);
-	clear_gfx();
-	rgs.pc = 0x200;
-	rgs.sp = 15;
-	chip8_draw_flag = true;
-	srand(get_msec_now());
+	struct chip8_beep* const beep =
+		&ctx->beeps[ctx->nbeeps < CHIP8_BEEPS ? ctx->nbeeps++ : CHIP8_BEEPS - 1];
+	beep->cycle = cycle;
+	beep->on = on;
+	ctx->beeping = on;
 }
 
-void chip8_step(void)
+/* DT and ST tick at CHIP8_TIMER_FREQ measured in emulated cycles. they
+ * are only observable by Fx07, Fx15, Fx18 and the host, so they are
+ * brought up to date lazily right before those. ctx->cycles must count
+ * the instructions before the current one, the remainder is kept in
+ * timer_acc so the rate is exact over CHIP8_FREQ
+ */
+void chip8_sync_timers(struct chip8* const ctx)
 {
-	static bool waiting_keypress = false;
+	const uint32_t start = ctx->timer_cycles;
+	const uint32_t elapsed = ctx->cycles - start;
+	const uint8_t st = ctx->rgs.st;
+	uint32_t ticks, until;
 
-	uint8_t ophi, oplo, x, y;
-	uint16_t opcode;
+	ctx->timer_cycles = ctx->cycles;
 
-	update_dt_st();
+	/* an Fx18 changes ST right after a sync, so a change is from then */
+	if ((st > 0) != ctx->beeping)
+		log_beep(ctx, start, st > 0);
 
-	if (waiting_keypress && !chip8_keys)
+	if (ctx->host_timers)
 		return;
-	else if (waiting_keypress)
-		waiting_keypress = false;
 
-	ASSERT_MSG(rgs.pc <= 0x0FFF, "Chip8 PC Register out of range");
-	ophi = ram[rgs.pc++];
-	oplo = ram[rgs.pc++];
-	x = ophi&0x0F;
-	y = (oplo&0xF0)>>4;
-	opcode = (ophi<<8)|oplo;
+	/* the buzzer stops on the cycle ST ticks down to 0 */
+	if (st > 0) {
+		until = (st * CHIP8_FREQ - ctx->timer_acc + CHIP8_TIMER_FREQ - 1) /
+		        CHIP8_TIMER_FREQ;
+		if (until <= elapsed)
+			log_beep(ctx, start + until, false);
+	}
+
+	ticks = (elapsed / CHIP8_FREQ) * CHIP8_TIMER_FREQ;
+	ctx->timer_acc += (elapsed % CHIP8_FREQ) * CHIP8_TIMER_FREQ;
+	ticks += ctx->timer_acc / CHIP8_FREQ;
+	ctx->timer_acc %= CHIP8_FREQ;
+
+	ctx->rgs.dt = ctx->rgs.dt > ticks ? ctx->rgs.dt - ticks : 0;
+	ctx->rgs.st = ctx->rgs.st > ticks ? ctx->rgs.st - ticks : 0;
+}
+
+/* only the rows that had something lit are damaged */
+static void clear_gfx(struct chip8* const ctx)
+{
+	const uint8_t height = ctx->hires ? CHIP8_SCR_HEIGHT : CHIP8_LORES_HEIGHT;
+	uint8_t y;
+
+	for (y = 0; y < height; ++y)
+		set_row(ctx, y, 0, 0);
+}
+
+/* 00FE and 00FF clear the display, a blank one renders the same
+ * in both modes so only the lit rows are damaged
+ */
+static void set_hires(struct chip8* const ctx, const bool hires)
+{
+	clear_gfx(ctx);
+	ctx->hires = hires;
+}
+
+static void store_flags(struct chip8* const ctx, const uint8_t x)
+{
+	memcpy(ctx->flags, &ctx->rgs.v[0], (x&(CHIP8_FLAGS - 1)) + 1);
+}
+
+static void load_flags(struct chip8* const ctx, const uint8_t x)
+{
+	memcpy(&ctx->rgs.v[0], ctx->flags, (x&(CHIP8_FLAGS - 1)) + 1);
+}
+
+
+/* pc must already point past the opcode */
+void chip8_exec_opcode(struct chip8* const ctx, const uint16_t opcode)
+{
+	const uint8_t ophi = opcode>>8;
+	const uint8_t oplo = opcode&0xFF;
+	const uint8_t x = ophi&0x0F;
+	const uint8_t y = (oplo&0xF0)>>4;
 
 	switch ((ophi&0xF0)>>4) {
-	default: unknown_opcode(opcode); break;
+	default: unknown_opcode(ctx, opcode); break;
 	case 0x00:
 		switch (oplo) {
-		default: unknown_opcode(opcode); break;
+		default:
+			if ((oplo&0xF0) == 0xC0) /* 00Cn - SCD nibble Scroll display n lines down. */
+				scroll_down(ctx, oplo&0x0F);
+			else
+				unknown_opcode(ctx, opcode);
+			break;
 		case 0xE0: /* - CLS clear display */
-			clear_gfx();
-			chip8_draw_flag = true;
+			clear_gfx(ctx);
 			break;
 		case 0xEE: /* - RET Return from a subroutine. */
-			rgs.pc = stackpop();
+			ctx->rgs.pc = stackpop(ctx);
+			break;
+		case 0xFB: /* 00FB - SCR Scroll display 4 pixels right. */
+			scroll_side(ctx, false);
+			break;
+		case 0xFC: /* 00FC - SCL Scroll display 4 pixels left. */
+			scroll_side(ctx, true);
+			break;
+		case 0xFE: /* 00FE - LOW Disable extended screen mode. */
+			set_hires(ctx, false);
+			break;
+		case 0xFF: /* 00FF - HIGH Enable extended screen mode for full-screen graphics. */
+			set_hires(ctx, true);
 			break;
 		}
 		break;
 
 	case 0x01: /* 1nnn - JP addr Jump to location nnn. */
-		rgs.pc = opcode&0x0FFF;
+		ctx->rgs.pc = opcode&0x0FFF;
 		break; 
 	case 0x02: /* 2nnn - CALL addr Call subroutine at nnn. */
-		stackpush(rgs.pc);
-		rgs.pc = opcode&0x0FFF;
+		stackpush(ctx, ctx->rgs.pc);
+		ctx->rgs.pc = opcode&0x0FFF;
 		break;
 	case 0x03: /* 3xkk - SE Vx, byte Skip next instruction if Vx = kk. */
-		if (rgs.v[x] == oplo)
-			rgs.pc += 2;
+		if (ctx->rgs.v[x] == oplo)
+			ctx->rgs.pc += 2;
 		break;
 	case 0x04: /* 4xkk - SNE Vx, byte Skip next instruction if Vx != kk. */
-		if (rgs.v[x] != oplo)
-			rgs.pc += 2;
+		if (ctx->rgs.v[x] != oplo)
+			ctx->rgs.pc += 2;
 		break;
 	case 0x05:  /* 5xy0 - SE Vx, Vy Skip next instruction if Vx = Vy. */
-		if (rgs.v[x] == rgs.v[y])
-			rgs.pc += 2;
+		if (ctx->rgs.v[x] == ctx->rgs.v[y])
+			ctx->rgs.pc += 2;
 		break;
 	case 0x06:  /* 6xkk - LD Vx, byte Set Vx = kk. */
-		rgs.v[x] = oplo;
+		ctx->rgs.v[x] = oplo;
 		break;
 	case 0x07:  /* 7xkk - ADD Vx, byte Set Vx = Vx + kk. */
-		rgs.v[x] += oplo;
+		ctx->rgs.v[x] += oplo;
 		break;
 
 	case 0x08:
 		switch (oplo&0x0F) {
-		default: unknown_opcode(opcode); break;
+		default: unknown_opcode(ctx, opcode); break;
 		case 0x00: /* 8xy0 - LD Vx, Vy Set Vx = Vy. */
-			rgs.v[x] = rgs.v[y];
+			ctx->rgs.v[x] = ctx->rgs.v[y];
 			break;
 		case 0x01: /* 8xy1 - OR Vx, Vy Set Vx = Vx OR Vy. */
-			rgs.v[x] |= rgs.v[y];
+			ctx->rgs.v[x] |= ctx->rgs.v[y];
 			break;
 		case 0x02: /* 8xy2 - AND Vx, Vy Set Vx = Vx AND Vy. */
-			rgs.v[x] &= rgs.v[y];
+			ctx->rgs.v[x] &= ctx->rgs.v[y];
 			break;
 		case 0x03: /* 8xy3 - XOR Vx, Vy Set Vx = Vx XOR Vy.  */
-			rgs.v[x] ^= rgs.v[y];
+			ctx->rgs.v[x] ^= ctx->rgs.v[y];
 			break;
 		case 0x04: /* 8xy4 - ADD Vx, Vy Set Vx = Vx + Vy, set VF = carry. */
-			rgs.v[0x0F] = (rgs.v[x] + rgs.v[y]) > 0xFF;
-			rgs.v[x] += rgs.v[y];
+			ctx->rgs.v[0x0F] = (ctx->rgs.v[x] + ctx->rgs.v[y]) > 0xFF;
+			ctx->rgs.v[x] += ctx->rgs.v[y];
 			break;
 		case 0x05: /* 8xy5 - SUB Vx, Vy Set Vx = Vx - Vy, set VF = NOT borrow. */
-			rgs.v[0x0F] = rgs.v[x] > rgs.v[y];
-			rgs.v[x] -= rgs.v[y];
+			ctx->rgs.v[0x0F] = ctx->rgs.v[x] > ctx->rgs.v[y];
+			ctx->rgs.v[x] -= ctx->rgs.v[y];
 			break;
 		case 0x06: /* 8xy6 - SHR Vx {, Vy} Set Vx = Vx SHR 1. */
-			rgs.v[0x0F] = rgs.v[x]&0x01;
-			rgs.v[x] >>= 1;
+			ctx->rgs.v[0x0F] = ctx->rgs.v[x]&0x01;
+			ctx->rgs.v[x] >>= 1;
 			break;
 		case 0x07: /* 8xy7 - SUBN Vx, Vy Set Vx = Vy - Vx, set VF = NOT borrow. */
-			rgs.v[0x0F] = rgs.v[y] > rgs.v[x];
-			rgs.v[x] = rgs.v[y] - rgs.v[x];
+			ctx->rgs.v[0x0F] = ctx->rgs.v[y] > ctx->rgs.v[x];
+			ctx->rgs.v[x] = ctx->rgs.v[y] - ctx->rgs.v[x];
 			break;
 		case 0x0E: /* 8xyE - SHL Vx {, Vy} Set Vx = Vx SHL 1.  */
-			rgs.v[0x0F] = (rgs.v[x]&0x80) != 0;
-			rgs.v[x] <<= 1;
+			ctx->rgs.v[0x0F] = (ctx->rgs.v[x]&0x80) != 0;
+			ctx->rgs.v[x] <<= 1;
 			break;
 		}
 		break;
 
 	case 0x09: /* 9xy0 - SNE Vx, Vy Skip next instruction if Vx != Vy. */
-		if (rgs.v[x] != rgs.v[y])
-			rgs.pc += 2;
+		if (ctx->rgs.v[x] != ctx->rgs.v[y])
+			ctx->rgs.pc += 2;
 		break;
 	case 0x0A: /* Annn - LD I, addr Set I = nnn. The value of register I is set to nnn. */
-		rgs.i = opcode&0x0FFF;
+		ctx->rgs.i = opcode&0x0FFF;
 		break;
 	case 0x0B: /* Bnnn - JP V0, addr Jump to location nnn + V0. */
-		rgs.pc = (opcode&0x0FFF) + rgs.v[0];
+		ctx->rgs.pc = (opcode&0x0FFF) + ctx->rgs.v[0];
 		break;
 	case 0x0C: /* Cxkk - RND Vx, byte Set Vx = random byte AND kk. */
-		rgs.v[x] = rand()&oplo;
+		ctx->rgs.v[x] = next_random(ctx)&oplo;
 		break;
 	case 0x0D: /* Dxyn - DRW Vx, Vy, nibble Display n-byte sprite starting at memory location I at (Vx, Vy)... */
-		draw(rgs.v[x], rgs.v[y], oplo&0x0F);
+		draw(ctx, ctx->rgs.v[x], ctx->rgs.v[y], oplo&0x0F);
 		break;
 	case 0x0E:
 		if (oplo == 0x9E) { /* Ex9E - SKP Vx Skip next instruction if key with the value of Vx is pressed. */
-			if ((0x1<<rgs.v[x])&chip8_keys)
-				rgs.pc += 2;
+			if ((0x1<<ctx->rgs.v[x])&ctx->keys)
+				ctx->rgs.pc += 2;
 		} else if (oplo == 0xA1) { /* ExA1 - SKNP Vx Skip next instruction if key with the value of Vx is not pressed. */
-			if (!((0x1<<rgs.v[x])&chip8_keys))
-				rgs.pc += 2;
+			if (!((0x1<<ctx->rgs.v[x])&ctx->keys))
+				ctx->rgs.pc += 2;
 		}
 		break;
 	case 0x0F:
 		switch (oplo) {
-		default: unknown_opcode(opcode); break;
+		default: unknown_opcode(ctx, opcode); break;
 		case 0x07: /* Fx07 - LD Vx, DT Set Vx = delay timer value. The value of DT is placed into Vx. */
-			rgs.v[x] = rgs.dt;
+			chip8_sync_timers(ctx);
+			ctx->rgs.v[x] = ctx->rgs.dt;
 			break;
 		case 0x0A: /* Fx0A - LD Vx, K Wait for a key press, store the value of the key in Vx. */
-			chip8_keys = 0x0000;
-			waiting_keypress = true;
+			wait_key(ctx, x);
 			break;
 		case 0x15: /* Fx15 - LD DT, Vx Set delay timer = Vx. */
-			rgs.dt = rgs.v[x];
+			chip8_sync_timers(ctx);
+			ctx->rgs.dt = ctx->rgs.v[x];
 			break;
 		case 0x18: /* Fx18 - LD ST, Vx Set sound timer = Vx. */
-			rgs.st = rgs.v[x];
+			chip8_sync_timers(ctx);
+			ctx->rgs.st = ctx->rgs.v[x];
 			break;
 		case 0x1E: /* Fx1E - ADD I, Vx Set I = I + Vx. */
-			rgs.i += rgs.v[x];
+			ctx->rgs.i += ctx->rgs.v[x];
 			break;
 		case 0x29: /* Fx29 - LD F, Vx Set I = location of sprite for digit Vx. */
-			rgs.i = rgs.v[x] * 5;
+			ctx->rgs.i = ctx->rgs.v[x] * 5;
+			break;
+		case 0x30: /* Fx30 - LD HF, Vx Set I = location of the 8x10 sprite for digit Vx. */
+			ctx->rgs.i = sizeof font + ctx->rgs.v[x] * 10;
 			break;
 		case 0x33: /* Fx33 - LD B, Vx Store BCD representation of Vx in memory locations I, I+1, and I+2. */
-			ram[rgs.i + 2] = rgs.v[x] % 10;
-			ram[rgs.i + 1] = (rgs.v[x] / 10) % 10;
-			ram[rgs.i] = rgs.v[x] / 100;
+			store_bcd(ctx, ctx->rgs.v[x]);
 			break;
 		case 0x55: /* Fx55 - LD [I], Vx Store registers V0 through Vx in memory starting at location I. */
-			memcpy(&ram[rgs.i], &rgs.v[0], x + 1);
+			store_regs(ctx, x);
 			break;
 		case 0x65: /* Fx65 - LD Vx, [I] Read registers V0 through Vx from memory starting at location I. */
-			memcpy(&rgs.v[0], &ram[rgs.i], x + 1);
+			load_regs(ctx, x);
+			break;
+		case 0x75: /* Fx75 - LD R, Vx Store V0 through Vx in the RPL user flags. */
+			store_flags(ctx, x);
+			break;
+		case 0x85: /* Fx85 - LD Vx, R Read V0 through Vx from the RPL user flags. */
+			load_flags(ctx, x);
 			break;
 		}
 		break;
@@ -296,4 +712,981 @@ void chip8_step(void)
 
 }
 
+static void interpret(struct chip8* const ctx)
+{
+	const uint16_t opcode = (ctx->ram[ctx->rgs.pc]<<8)|ctx->ram[ctx->rgs.pc + 1];
+	ctx->rgs.pc += 2;
+	chip8_exec_opcode(ctx, opcode);
+}
+
+static void decode(struct chip8_op* const op,
+                   const uint8_t ophi, const uint8_t oplo)
+{
+	op->x = ophi&0x0F;
+	op->y = (oplo&0xF0)>>4;
+	op->kk = oplo;
+	op->nnn = ((ophi<<8)|oplo)&0x0FFF;
+
+	switch ((ophi&0xF0)>>4) {
+	default: op->handler = OP_UNKNOWN; break;
+	case 0x00:
+		switch (oplo) {
+		default:
+			op->handler = (oplo&0xF0) == 0xC0 ? OP_SCD_N : OP_UNKNOWN;
+			break;
+		case 0xE0: op->handler = OP_CLS; break;
+		case 0xEE: op->handler = OP_RET; break;
+		case 0xFB: op->handler = OP_SCR; break;
+		case 0xFC: op->handler = OP_SCL; break;
+		case 0xFE: op->handler = OP_LOW; break;
+		case 0xFF: op->handler = OP_HIGH; break;
+		}
+		break;
+	case 0x01: op->handler = OP_JP; break;
+	case 0x02: op->handler = OP_CALL; break;
+	case 0x03: op->handler = OP_SE_VX_KK; break;
+	case 0x04: op->handler = OP_SNE_VX_KK; break;
+	case 0x05: op->handler = OP_SE_VX_VY; break;
+	case 0x06: op->handler = OP_LD_VX_KK; break;
+	case 0x07: op->handler = OP_ADD_VX_KK; break;
+	case 0x08:
+		switch (oplo&0x0F) {
+		default: op->handler = OP_UNKNOWN; break;
+		case 0x00: op->handler = OP_LD_VX_VY; break;
+		case 0x01: op->handler = OP_OR_VX_VY; break;
+		case 0x02: op->handler = OP_AND_VX_VY; break;
+		case 0x03: op->handler = OP_XOR_VX_VY; break;
+		case 0x04: op->handler = OP_ADD_VX_VY; break;
+		case 0x05: op->handler = OP_SUB_VX_VY; break;
+		case 0x06: op->handler = OP_SHR_VX; break;
+		case 0x07: op->handler = OP_SUBN_VX_VY; break;
+		case 0x0E: op->handler = OP_SHL_VX; break;
+		}
+		break;
+	case 0x09: op->handler = OP_SNE_VX_VY; break;
+	case 0x0A: op->handler = OP_LD_I_NNN; break;
+	case 0x0B: op->handler = OP_JP_V0_NNN; break;
+	case 0x0C: op->handler = OP_RND_VX_KK; break;
+	case 0x0D: op->handler = OP_DRW_VX_VY_N; break;
+	case 0x0E:
+		switch (oplo) {
+		default: op->handler = OP_NOP; break;
+		case 0x9E: op->handler = OP_SKP_VX; break;
+		case 0xA1: op->handler = OP_SKNP_VX; break;
+		}
+		break;
+	case 0x0F:
+		switch (oplo) {
+		default: op->handler = OP_UNKNOWN; break;
+		case 0x07: op->handler = OP_LD_VX_DT; break;
+		case 0x0A: op->handler = OP_LD_VX_K; break;
+		case 0x15: op->handler = OP_LD_DT_VX; break;
+		case 0x18: op->handler = OP_LD_ST_VX; break;
+		case 0x1E: op->handler = OP_ADD_I_VX; break;
+		case 0x29: op->handler = OP_LD_F_VX; break;
+		case 0x30: op->handler = OP_LD_HF_VX; break;
+		case 0x33: op->handler = OP_LD_B_VX; break;
+		case 0x55: op->handler = OP_LD_MI_VX; break;
+		case 0x65: op->handler = OP_LD_VX_MI; break;
+		case 0x75: op->handler = OP_LD_R_VX; break;
+		case 0x85: op->handler = OP_LD_VX_R; break;
+		}
+		break;
+	}
+}
+
+static void execute_predecoded(struct chip8* const ctx)
+{
+	struct chip8_op* const op = &ctx->ops[ctx->rgs.pc];
+	uint8_t* const v = ctx->rgs.v;
+
+	if (op->handler == OP_UNDECODED)
+		decode(op, ctx->ram[ctx->rgs.pc], ctx->ram[ctx->rgs.pc + 1]);
+
+	ctx->rgs.pc += 2;
+
+	switch (op->handler) {
+	case OP_UNDECODED:
+	case OP_UNKNOWN:
+		unknown_opcode(ctx, (ctx->ram[ctx->rgs.pc - 2]<<8)|ctx->ram[ctx->rgs.pc - 1]);
+		break;
+	case OP_NOP: break;
+	case OP_CLS:
+		clear_gfx(ctx);
+		break;
+	case OP_RET: ctx->rgs.pc = stackpop(ctx); break;
+	case OP_JP: ctx->rgs.pc = op->nnn; break;
+	case OP_CALL:
+		stackpush(ctx, ctx->rgs.pc);
+		ctx->rgs.pc = op->nnn;
+		break;
+	case OP_SE_VX_KK:
+		if (v[op->x] == op->kk)
+			ctx->rgs.pc += 2;
+		break;
+	case OP_SNE_VX_KK:
+		if (v[op->x] != op->kk)
+			ctx->rgs.pc += 2;
+		break;
+	case OP_SE_VX_VY:
+		if (v[op->x] == v[op->y])
+			ctx->rgs.pc += 2;
+		break;
+	case OP_LD_VX_KK: v[op->x] = op->kk; break;
+	case OP_ADD_VX_KK: v[op->x] += op->kk; break;
+	case OP_LD_VX_VY: v[op->x] = v[op->y]; break;
+	case OP_OR_VX_VY: v[op->x] |= v[op->y]; break;
+	case OP_AND_VX_VY: v[op->x] &= v[op->y]; break;
+	case OP_XOR_VX_VY: v[op->x] ^= v[op->y]; break;
+	case OP_ADD_VX_VY:
+		v[0x0F] = (v[op->x] + v[op->y]) > 0xFF;
+		v[op->x] += v[op->y];
+		break;
+	case OP_SUB_VX_VY:
+		v[0x0F] = v[op->x] > v[op->y];
+		v[op->x] -= v[op->y];
+		break;
+	case OP_SHR_VX:
+		v[0x0F] = v[op->x]&0x01;
+		v[op->x] >>= 1;
+		break;
+	case OP_SUBN_VX_VY:
+		v[0x0F] = v[op->y] > v[op->x];
+		v[op->x] = v[op->y] - v[op->x];
+		break;
+	case OP_SHL_VX:
+		v[0x0F] = (v[op->x]&0x80) != 0;
+		v[op->x] <<= 1;
+		break;
+	case OP_SNE_VX_VY:
+		if (v[op->x] != v[op->y])
+			ctx->rgs.pc += 2;
+		break;
+	case OP_LD_I_NNN: ctx->rgs.i = op->nnn; break;
+	case OP_JP_V0_NNN: ctx->rgs.pc = op->nnn + v[0]; break;
+	case OP_RND_VX_KK: v[op->x] = next_random(ctx)&op->kk; break;
+	case OP_DRW_VX_VY_N: draw(ctx, v[op->x], v[op->y], op->kk&0x0F); break;
+	case OP_SKP_VX:
+		if ((0x1<<v[op->x])&ctx->keys)
+			ctx->rgs.pc += 2;
+		break;
+	case OP_SKNP_VX:
+		if (!((0x1<<v[op->x])&ctx->keys))
+			ctx->rgs.pc += 2;
+		break;
+	case OP_LD_VX_DT:
+		chip8_sync_timers(ctx);
+		v[op->x] = ctx->rgs.dt;
+		break;
+	case OP_LD_VX_K: wait_key(ctx, op->x); break;
+	case OP_LD_DT_VX:
+		chip8_sync_timers(ctx);
+		ctx->rgs.dt = v[op->x];
+		break;
+	case OP_LD_ST_VX:
+		chip8_sync_timers(ctx);
+		ctx->rgs.st = v[op->x];
+		break;
+	case OP_ADD_I_VX: ctx->rgs.i += v[op->x]; break;
+	case OP_LD_F_VX: ctx->rgs.i = v[op->x] * 5; break;
+	case OP_LD_B_VX: store_bcd(ctx, v[op->x]); break;
+	case OP_LD_MI_VX: store_regs(ctx, op->x); break;
+	case OP_LD_VX_MI: load_regs(ctx, op->x); break;
+	case OP_SCD_N: scroll_down(ctx, op->kk&0x0F); break;
+	case OP_SCR: scroll_side(ctx, false); break;
+	case OP_SCL: scroll_side(ctx, true); break;
+	case OP_LOW: set_hires(ctx, false); break;
+	case OP_HIGH: set_hires(ctx, true); break;
+	case OP_LD_HF_VX: ctx->rgs.i = sizeof font + v[op->x] * 10; break;
+	case OP_LD_R_VX: store_flags(ctx, op->x); break;
+	case OP_LD_VX_R: load_flags(ctx, op->x); break;
+	}
+}
+
+/* recognizes the loops at pc which can only spin until DT or the keys
+ * change, returns their length in instructions or 0:
+ *   1nnn to itself
+ *   Ex9E or ExA1, 1nnn back
+ *   Fx07, 3xkk or 4xkk, 1nnn back
+ */
+int chip8_idle_loop_length(const struct chip8* const ctx, const uint16_t pc)
+{
+	const uint8_t* const p = &ctx->ram[pc];
+	const uint8_t jp_hi = 0x10|(pc>>8);
+	const uint8_t jp_lo = pc&0xFF;
+
+	if (pc > 0x0FFA)
+		return 0;
 
+	if (p[0] == jp_hi && p[1] == jp_lo)
+		return 1;
+
+	if ((p[0]&0xF0) == 0xE0 && (p[1] == 0x9E || p[1] == 0xA1) &&
+	    p[2] == jp_hi && p[3] == jp_lo)
+		return 2;
+
+	if ((p[0]&0xF0) == 0xF0 && p[1] == 0x07 &&
+	    (p[2] == (0x30|(p[0]&0x0F)) || p[2] == (0x40|(p[0]&0x0F))) &&
+	    p[4] == jp_hi && p[5] == jp_lo)
+		return 3;
+
+	return 0;
+}
+
+/* cycles from now until DT drops to target, DT must be above it
+ * and the timers up to date
+ */
+static uint32_t cycles_until_dt(const struct chip8* const ctx, const uint8_t target)
+{
+	const uint32_t ticks = ctx->rgs.dt - target;
+	return (ticks * CHIP8_FREQ - ctx->timer_acc + CHIP8_TIMER_FREQ - 1) / CHIP8_TIMER_FREQ;
+}
+
+/* jumps over the whole iterations of the idle loop at pc which can't
+ * get out within the budget, then steps into the loop so the engines
+ * resume past its head. the skipped iterations would have changed
+ * nothing but the cycles and the Vx of Fx07, so this is exact. returns
+ * the cycles emulated, all but the one stepped count as skipped
+ */
+static int skip_idle_loop(struct chip8* const ctx, const int len, const int budget)
+{
+	const uint8_t* const p = &ctx->ram[ctx->rgs.pc];
+	const uint8_t x = p[0]&0x0F;
+	uint32_t iters = budget / len;
+	uint32_t needed;
+	bool pressed, se;
+	int skip;
+
+	chip8_sync_timers(ctx);
+
+	if (len == 2) {
+		pressed = ((0x01<<ctx->rgs.v[x])&ctx->keys) != 0;
+		if (pressed == (p[1] == 0x9E))
+			iters = 0;
+	} else if (len == 3) {
+		se = (p[2]&0xF0) == 0x30;
+		if (se ? ctx->rgs.dt == p[3] : ctx->rgs.dt != p[3]) {
+			iters = 0;
+		} else if (!ctx->host_timers && (se ? ctx->rgs.dt > p[3] : p[3] > 0)) {
+			needed = cycles_until_dt(ctx, se ? p[3] : p[3] - 1);
+			needed = (needed + 2) / 3;
+			if (needed < iters)
+				iters = needed;
+		}
+	}
+
+	skip = iters * len;
+
+	if (len == 3 && skip > 0) {
+		/* Vx keeps what the last skipped Fx07 read */
+		ctx->cycles += skip - 3;
+		chip8_sync_timers(ctx);
+		ctx->rgs.v[x] = ctx->rgs.dt;
+		ctx->cycles += 3;
+	} else {
+		ctx->cycles += skip;
+	}
+	ctx->skipped += skip;
+
+	if (skip < budget) {
+		interpret(ctx);
+		++ctx->cycles;
+		++skip;
+	}
+
+	return skip;
+}
+
+/* runs single instructions until the budget is spent or something
+ * chip8_run() has to look at happens, like landing on an idle loop
+ */
+static int execute_single(struct chip8* const ctx, const int budget)
+{
+	const uint32_t dirty = ctx->dirty_rows;
+	const bool predecoded = ctx->engine == CHIP8ENGINE_PREDECODE;
+	uint16_t pc;
+	int n = 0;
+	#ifdef CHIP8_PROFILE
+	struct chip8_op op;
+	uint64_t start;
+	#endif
+
+	do {
+		pc = ctx->rgs.pc;
+		#ifdef CHIP8_PROFILE
+		decode(&op, ctx->ram[pc], ctx->ram[pc + 1]);
+		start = PROFILE_TICKS();
+		#endif
+		if (predecoded)
+			execute_predecoded(ctx);
+		else
+			interpret(ctx);
+		#ifdef CHIP8_PROFILE
+		ctx->profile.ticks[op.handler - 1] += PROFILE_TICKS() - start;
+		++ctx->profile.count[op.handler - 1];
+		#endif
+		++ctx->cycles;
+		++n;
+
+		if (ctx->rgs.pc <= pc && chip8_idle_loop_length(ctx, ctx->rgs.pc))
+			break;
+	} while (n < budget && ctx->dirty_rows == dirty &&
+	         ctx->state == CHIP8STATE_RUNNING &&
+	         ctx->rgs.pc <= CHIP8_PC_MAX);
+
+	return n;
+}
+
+
+#ifdef CHIP8_HAVE_THREADED
+static bool is_block_end(const uint8_t handler)
+{
+	switch (handler) {
+	case OP_RET: case OP_JP: case OP_CALL: case OP_JP_V0_NNN:
+	case OP_SE_VX_KK: case OP_SNE_VX_KK: case OP_SE_VX_VY:
+	case OP_SNE_VX_VY: case OP_SKP_VX: case OP_SKNP_VX:
+	case OP_LD_VX_K: case OP_LD_B_VX: case OP_LD_MI_VX:
+	case OP_CLS: case OP_DRW_VX_VY_N: case OP_SCD_N: case OP_SCR:
+	case OP_SCL: case OP_LOW: case OP_HIGH:
+	case OP_UNDECODED: case OP_UNKNOWN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_timer_op(const uint8_t handler)
+{
+	return handler == OP_LD_VX_DT ||
+	       handler == OP_LD_DT_VX ||
+	       handler == OP_LD_ST_VX;
+}
+
+/* Fx33 and Fx55 also end blocks, so a write into the running
+ * block is never followed by its stale instructions. 00E0, Dxyn and
+ * the SUPER-CHIP display opcodes end blocks so chip8_run() can stop
+ * right after a draw, and timer
+ * opcodes are kept at the start of a block where ctx->cycles is exact
+ */
+static struct chip8_block* translate_block(struct chip8* const ctx,
+                                           uint16_t pc,
+                                           const void* const* const labels,
+                                           const void* const end_label)
+{
+	struct chip8_blocks* const cache = ctx->blocks;
+	struct chip8_block* block;
+	struct chip8_tinstr* tinstr;
+	struct chip8_op op;
+
+	if (cache->used >= BLOCK_CACHE_SIZE)
+		flush_blocks(ctx);
+
+	block = &cache->pool[cache->used++];
+	block->start = pc;
+	block->ninstrs = 0;
+
+	for (;;) {
+		/* chip8_run() faults on a pc past the last whole opcode */
+		if (pc > CHIP8_PC_MAX) {
+			block->code[block->ninstrs].label = end_label;
+			break;
+		}
+
+		decode(&op, ctx->ram[pc], ctx->ram[pc + 1]);
+		cache->code_map[pc] = cache->code_map[pc + 1] = 1;
+
+		if (block->ninstrs > 0 && is_timer_op(op.handler)) {
+			block->code[block->ninstrs].label = end_label;
+			break;
+		}
+
+		tinstr = &block->code[block->ninstrs++];
+		tinstr->label = labels[op.handler];
+		tinstr->x = op.x;
+		tinstr->y = op.y;
+		tinstr->kk = op.kk;
+		tinstr->nnn = op.nnn;
+		pc += 2;
+
+		if (is_block_end(op.handler))
+			break;
+
+		if (block->ninstrs == BLOCK_MAX_INSTRS) {
+			block->code[block->ninstrs].label = end_label;
+			break;
+		}
+	}
+
+	block->end = pc;
+	cache->map[block->start] = block;
+	return block;
+}
+
+/* runs the whole basic block at pc, returns the number of instructions
+ * or 0 when the block doesn't fit in the budget
+ */
+static int execute_threaded(struct chip8* const ctx, const int budget)
+{
+	#define NEXT() goto *(++ip)->label
+
+	static const void* const labels[] = {
+		[OP_UNDECODED]   = &&op_unknown,
+		[OP_CLS]         = &&op_cls,
+		[OP_RET]         = &&op_ret,
+		[OP_JP]          = &&op_jp,
+		[OP_CALL]        = &&op_call,
+		[OP_SE_VX_KK]    = &&op_se_vx_kk,
+		[OP_SNE_VX_KK]   = &&op_sne_vx_kk,
+		[OP_SE_VX_VY]    = &&op_se_vx_vy,
+		[OP_LD_VX_KK]    = &&op_ld_vx_kk,
+		[OP_ADD_VX_KK]   = &&op_add_vx_kk,
+		[OP_LD_VX_VY]    = &&op_ld_vx_vy,
+		[OP_OR_VX_VY]    = &&op_or_vx_vy,
+		[OP_AND_VX_VY]   = &&op_and_vx_vy,
+		[OP_XOR_VX_VY]   = &&op_xor_vx_vy,
+		[OP_ADD_VX_VY]   = &&op_add_vx_vy,
+		[OP_SUB_VX_VY]   = &&op_sub_vx_vy,
+		[OP_SHR_VX]      = &&op_shr_vx,
+		[OP_SUBN_VX_VY]  = &&op_subn_vx_vy,
+		[OP_SHL_VX]      = &&op_shl_vx,
+		[OP_SNE_VX_VY]   = &&op_sne_vx_vy,
+		[OP_LD_I_NNN]    = &&op_ld_i_nnn,
+		[OP_JP_V0_NNN]   = &&op_jp_v0_nnn,
+		[OP_RND_VX_KK]   = &&op_rnd_vx_kk,
+		[OP_DRW_VX_VY_N] = &&op_drw_vx_vy_n,
+		[OP_SKP_VX]      = &&op_skp_vx,
+		[OP_SKNP_VX]     = &&op_sknp_vx,
+		[OP_LD_VX_DT]    = &&op_ld_vx_dt,
+		[OP_LD_VX_K]     = &&op_ld_vx_k,
+		[OP_LD_DT_VX]    = &&op_ld_dt_vx,
+		[OP_LD_ST_VX]    = &&op_ld_st_vx,
+		[OP_ADD_I_VX]    = &&op_add_i_vx,
+		[OP_LD_F_VX]     = &&op_ld_f_vx,
+		[OP_LD_B_VX]     = &&op_ld_b_vx,
+		[OP_LD_MI_VX]    = &&op_ld_mi_vx,
+		[OP_LD_VX_MI]    = &&op_ld_vx_mi,
+		[OP_SCD_N]       = &&op_scd_n,
+		[OP_SCR]         = &&op_scr,
+		[OP_SCL]         = &&op_scl,
+		[OP_LOW]         = &&op_low,
+		[OP_HIGH]        = &&op_high,
+		[OP_LD_HF_VX]    = &&op_ld_hf_vx,
+		[OP_LD_R_VX]     = &&op_ld_r_vx,
+		[OP_LD_VX_R]     = &&op_ld_vx_r,
+		[OP_NOP]         = &&op_nop,
+		[OP_UNKNOWN]     = &&op_unknown
+	};
+
+	struct chip8_block* block = ctx->blocks->map[ctx->rgs.pc];
+	const struct chip8_tinstr* ip;
+	uint8_t* const v = ctx->rgs.v;
+
+	if (block == NULL)
+		block = translate_block(ctx, ctx->rgs.pc, labels, &&block_end);
+
+	if (block->ninstrs > budget)
+		return 0;
+
+	ip = block->code;
+	goto *ip->label;
+
+	/* straight line instructions */
+op_ld_vx_kk: v[ip->x] = ip->kk; NEXT();
+op_add_vx_kk: v[ip->x] += ip->kk; NEXT();
+op_ld_vx_vy: v[ip->x] = v[ip->y]; NEXT();
+op_or_vx_vy: v[ip->x] |= v[ip->y]; NEXT();
+op_and_vx_vy: v[ip->x] &= v[ip->y]; NEXT();
+op_xor_vx_vy: v[ip->x] ^= v[ip->y]; NEXT();
+op_add_vx_vy:
+	v[0x0F] = (v[ip->x] + v[ip->y]) > 0xFF;
+	v[ip->x] += v[ip->y];
+	NEXT();
+op_sub_vx_vy:
+	v[0x0F] = v[ip->x] > v[ip->y];
+	v[ip->x] -= v[ip->y];
+	NEXT();
+op_shr_vx:
+	v[0x0F] = v[ip->x]&0x01;
+	v[ip->x] >>= 1;
+	NEXT();
+op_subn_vx_vy:
+	v[0x0F] = v[ip->y] > v[ip->x];
+	v[ip->x] = v[ip->y] - v[ip->x];
+	NEXT();
+op_shl_vx:
+	v[0x0F] = (v[ip->x]&0x80) != 0;
+	v[ip->x] <<= 1;
+	NEXT();
+op_ld_i_nnn: ctx->rgs.i = ip->nnn; NEXT();
+op_rnd_vx_kk: v[ip->x] = next_random(ctx)&ip->kk; NEXT();
+op_ld_vx_dt: chip8_sync_timers(ctx); v[ip->x] = ctx->rgs.dt; NEXT();
+op_ld_dt_vx: chip8_sync_timers(ctx); ctx->rgs.dt = v[ip->x]; NEXT();
+op_ld_st_vx: chip8_sync_timers(ctx); ctx->rgs.st = v[ip->x]; NEXT();
+op_add_i_vx: ctx->rgs.i += v[ip->x]; NEXT();
+op_ld_f_vx: ctx->rgs.i = v[ip->x] * 5; NEXT();
+op_ld_vx_mi: load_regs(ctx, ip->x); NEXT();
+op_ld_hf_vx: ctx->rgs.i = sizeof font + v[ip->x] * 10; NEXT();
+op_ld_r_vx: store_flags(ctx, ip->x); NEXT();
+op_ld_vx_r: load_flags(ctx, ip->x); NEXT();
+op_nop: NEXT();
+
+	/* block terminators */
+op_ret:
+	ctx->rgs.pc = stackpop(ctx);
+	return block->ninstrs;
+op_jp:
+	ctx->rgs.pc = ip->nnn;
+	return block->ninstrs;
+op_call:
+	stackpush(ctx, block->end);
+	ctx->rgs.pc = ip->nnn;
+	return block->ninstrs;
+op_jp_v0_nnn:
+	ctx->rgs.pc = ip->nnn + v[0];
+	return block->ninstrs;
+op_se_vx_kk:
+	ctx->rgs.pc = block->end + ((v[ip->x] == ip->kk) ? 2 : 0);
+	return block->ninstrs;
+op_sne_vx_kk:
+	ctx->rgs.pc = block->end + ((v[ip->x] != ip->kk) ? 2 : 0);
+	return block->ninstrs;
+op_se_vx_vy:
+	ctx->rgs.pc = block->end + ((v[ip->x] == v[ip->y]) ? 2 : 0);
+	return block->ninstrs;
+op_sne_vx_vy:
+	ctx->rgs.pc = block->end + ((v[ip->x] != v[ip->y]) ? 2 : 0);
+	return block->ninstrs;
+op_skp_vx:
+	ctx->rgs.pc = block->end + (((0x1<<v[ip->x])&ctx->keys) ? 2 : 0);
+	return block->ninstrs;
+op_sknp_vx:
+	ctx->rgs.pc = block->end + (((0x1<<v[ip->x])&ctx->keys) ? 0 : 2);
+	return block->ninstrs;
+op_ld_vx_k:
+	wait_key(ctx, ip->x);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_cls:
+	clear_gfx(ctx);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_drw_vx_vy_n:
+	draw(ctx, v[ip->x], v[ip->y], ip->kk&0x0F);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_scd_n:
+	scroll_down(ctx, ip->kk&0x0F);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_scr:
+	scroll_side(ctx, false);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_scl:
+	scroll_side(ctx, true);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_low:
+	set_hires(ctx, false);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_high:
+	set_hires(ctx, true);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_ld_b_vx:
+	store_bcd(ctx, v[ip->x]);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_ld_mi_vx:
+	store_regs(ctx, ip->x);
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+op_unknown:
+	ctx->rgs.pc = block->end;
+	unknown_opcode(ctx, (ctx->ram[block->end - 2]<<8)|ctx->ram[block->end - 1]);
+	return block->ninstrs;
+block_end:
+	ctx->rgs.pc = block->end;
+	return block->ninstrs;
+
+	#undef NEXT
+}
+#endif
+
+struct chip8* chip8_create(void)
+{
+	struct chip8* const ctx = MALLOC(sizeof(struct chip8));
+	if (ctx == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	memset(ctx, 0, sizeof(struct chip8));
+	chip8_reset(ctx);
+	return ctx;
+}
+
+void chip8_destroy(struct chip8* const ctx)
+{
+	if (ctx->ops != NULL)
+		FREE(ctx->ops);
+	if (ctx->blocks != NULL)
+		FREE(ctx->blocks);
+	#ifdef CHIP8_HAVE_JIT
+	if (ctx->jit != NULL)
+		chip8_jit_destroy(ctx->jit);
+	#endif
+	FREE(ctx);
+}
+
+void chip8_loadrom(struct chip8* const ctx, const char* const fname)
+{
+	void* p = &ctx->ram[0x200];
+	load_files(&fname, &p, 1);
+	invalidate_code(ctx, 0x200, 0x1000 - 0x200);
+}
+
+void chip8_loadrom_raw(struct chip8* const ctx,
+                       const void* const data, const short size)
+{
+	memcpy(&ctx->ram[0x200], data, size);
+	invalidate_code(ctx, 0x200, size);
+}
+
+void chip8_reset(struct chip8* const ctx)
+{
+	memset(&ctx->rgs, 0, sizeof ctx->rgs);
+	memset(ctx->stack, 0, sizeof ctx->stack);
+	memcpy(ctx->ram, font, sizeof font);
+	memcpy(&ctx->ram[sizeof font], big_font, sizeof big_font);
+	invalidate_code(ctx, 0, sizeof font + sizeof big_font);
+	clear_gfx(ctx);
+	ctx->hires = false;
+	ctx->rgs.pc = 0x200;
+	ctx->rgs.sp = 15;
+	ctx->dirty_rows = CHIP8_DIRTY_ALL;
+	ctx->state = CHIP8STATE_RUNNING;
+	ctx->wait_reg = 0;
+	ctx->cycles = 0;
+	ctx->skipped = 0;
+	ctx->timer_cycles = 0;
+	ctx->timer_acc = 0;
+	ctx->rng = seed_state(ctx->seed);
+	ctx->nbeeps = 0;
+	ctx->beeping = false;
+}
+
+/* a packed row of width pixels, each drawn scale pixels wide */
+static void render_row(chip8_gfx_t* const pixels, uint64_t bits,
+                       const uint8_t width, const uint8_t scale)
+{
+	uint8_t x;
+
+	for (x = 0; x < width; ++x)
+		pixels[x] = CHIP8_GFX_BGC;
+
+	for (x = 0; bits != 0; x += scale, bits <<= 1) {
+		if (bits&0x8000000000000000ull) {
+			pixels[x] = CHIP8_GFX_FGC;
+			pixels[x + scale - 1] = CHIP8_GFX_FGC;
+		}
+	}
+}
+
+uint32_t chip8_render(struct chip8* const ctx,
+                      chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH])
+{
+	const uint8_t xoff = (CHIP8_GFX_WIDTH - CHIP8_SCR_WIDTH) / 2u;
+	const uint8_t yoff = (CHIP8_GFX_HEIGHT - CHIP8_SCR_HEIGHT) / 2u;
+	const uint32_t dirty = ctx->dirty_rows;
+	chip8_gfx_t* top;
+	chip8_gfx_t* bottom;
+	uint8_t x, y;
+
+	if (dirty == CHIP8_DIRTY_ALL) {
+		for (y = 0; y < CHIP8_GFX_HEIGHT; ++y)
+			for (x = 0; x < CHIP8_GFX_WIDTH; ++x)
+				pixels[y][x] = CHIP8_GFX_BGC;
+	}
+
+	for (y = 0; y < CHIP8_LORES_HEIGHT; ++y) {
+		if (!(dirty&(0x01ul<<y)))
+			continue;
+
+		top = &pixels[y * 2 + yoff][xoff];
+		bottom = &pixels[y * 2 + 1 + yoff][xoff];
+		if (ctx->hires) {
+			render_row(top, ctx->gfx[y * 2][0], 64, 1);
+			render_row(top + 64, ctx->gfx[y * 2][1], 64, 1);
+			render_row(bottom, ctx->gfx[y * 2 + 1][0], 64, 1);
+			render_row(bottom + 64, ctx->gfx[y * 2 + 1][1], 64, 1);
+		} else {
+			/* lores pixels are 2x2 */
+			render_row(top, ctx->gfx[y][0], CHIP8_SCR_WIDTH, 2);
+			memcpy(bottom, top, sizeof(chip8_gfx_t) * CHIP8_SCR_WIDTH);
+		}
+	}
+
+	ctx->dirty_rows = 0;
+	return dirty;
+}
+
+void chip8_save_state(const struct chip8* const ctx,
+                      struct chip8_state* const state)
+{
+	state->magic = CHIP8_STATE_MAGIC;
+	state->version = CHIP8_STATE_VERSION;
+	state->size = sizeof(struct chip8_state);
+	state->pc = ctx->rgs.pc;
+	state->i = ctx->rgs.i;
+	state->sp = ctx->rgs.sp;
+	state->dt = ctx->rgs.dt;
+	state->st = ctx->rgs.st;
+	state->state = ctx->state;
+	state->wait_reg = ctx->wait_reg;
+	state->host_timers = ctx->host_timers;
+	state->keys = ctx->keys;
+	state->cycles = ctx->cycles;
+	state->skipped = ctx->skipped;
+	state->timer_cycles = ctx->timer_cycles;
+	state->timer_acc = ctx->timer_acc;
+	state->seed = ctx->seed;
+	state->rng = ctx->rng;
+	state->hires = ctx->hires;
+	memset(state->pad, 0, sizeof state->pad);
+	memcpy(state->flags, ctx->flags, sizeof state->flags);
+	memcpy(state->v, ctx->rgs.v, sizeof state->v);
+	memcpy(state->stack, ctx->stack, sizeof state->stack);
+	memcpy(state->ram, ctx->ram, sizeof state->ram);
+	memcpy(state->gfx, ctx->gfx, sizeof state->gfx);
+}
+
+/* snapshots can come from disk, nothing in one may index past ctx */
+static bool state_valid(const struct chip8_state* const state)
+{
+	if (state->magic != CHIP8_STATE_MAGIC ||
+	    state->version != CHIP8_STATE_VERSION ||
+	    state->size != sizeof(struct chip8_state))
+		return false;
+
+	if (state->sp < -1 || state->sp > 15 || state->wait_reg > 0x0F ||
+	    state->i > 0x0FFF || state->rng == 0)
+		return false;
+
+	switch (state->state) {
+	case CHIP8STATE_RUNNING:
+	case CHIP8STATE_WAITKEY:
+		/* a Bnnn can leave a halted pc past the end, it's never fetched */
+		return state->pc <= CHIP8_PC_MAX;
+	case CHIP8STATE_HALTED:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* only the code caches over ram that differs get dropped, and only
+ * the rows that differ get damaged
+ */
+bool chip8_load_state(struct chip8* const ctx,
+                      const struct chip8_state* const state)
+{
+	uint16_t addr;
+	uint8_t y;
+
+	if (!state_valid(state))
+		return false;
+
+	for (addr = 0; addr < 0x1000; addr += 0x40) {
+		if (memcmp(&ctx->ram[addr], &state->ram[addr], 0x40) != 0)
+			invalidate_code(ctx, addr, 0x40);
+	}
+
+	if (ctx->hires != state->hires) {
+		ctx->dirty_rows = CHIP8_DIRTY_ALL;
+	} else {
+		for (y = 0; y < (ctx->hires ? CHIP8_SCR_HEIGHT : CHIP8_LORES_HEIGHT); ++y) {
+			if (ctx->gfx[y][0] != state->gfx[y][0] ||
+			    ctx->gfx[y][1] != state->gfx[y][1])
+				ctx->dirty_rows |= 0x01ul<<(ctx->hires ? y>>1 : y);
+		}
+	}
+
+	ctx->rgs.pc = state->pc;
+	ctx->rgs.i = state->i;
+	ctx->rgs.sp = state->sp;
+	ctx->rgs.dt = state->dt;
+	ctx->rgs.st = state->st;
+	ctx->state = state->state;
+	ctx->wait_reg = state->wait_reg;
+	ctx->host_timers = state->host_timers;
+	ctx->keys = state->keys;
+	ctx->cycles = state->cycles;
+	ctx->skipped = state->skipped;
+	ctx->timer_cycles = state->timer_cycles;
+	ctx->timer_acc = state->timer_acc;
+	ctx->seed = state->seed;
+	ctx->rng = state->rng;
+	ctx->hires = state->hires;
+	memcpy(ctx->flags, state->flags, sizeof ctx->flags);
+	/* snapshots are taken between runs, which end synced */
+	ctx->nbeeps = 0;
+	ctx->beeping = state->st > 0;
+	memcpy(ctx->rgs.v, state->v, sizeof state->v);
+	memcpy(ctx->stack, state->stack, sizeof state->stack);
+	memcpy(ctx->ram, state->ram, sizeof state->ram);
+	memcpy(ctx->gfx, state->gfx, sizeof state->gfx);
+	return true;
+}
+
+void chip8_seed(struct chip8* const ctx, const uint32_t seed)
+{
+	ctx->seed = seed;
+	ctx->rng = seed_state(seed);
+}
+
+void chip8_set_engine(struct chip8* const ctx, const enum Chip8Engine engine)
+{
+	#ifdef CHIP8_HAVE_JIT
+	if (engine == CHIP8ENGINE_JIT && ctx->jit == NULL)
+		ctx->jit = chip8_jit_create();
+	#else
+	if (engine == CHIP8ENGINE_JIT) {
+		chip8_set_engine(ctx, CHIP8ENGINE_THREADED);
+		return;
+	}
+	#endif
+
+	if (engine == CHIP8ENGINE_PREDECODE && ctx->ops == NULL) {
+		ctx->ops = MALLOC(sizeof(struct chip8_op) * 0x1000);
+		if (ctx->ops == NULL)
+			FATALERROR("Couldn't allocate memory!");
+		invalidate_code(ctx, 0, 0x1000);
+	}
+
+	#ifdef CHIP8_HAVE_THREADED
+	if (engine == CHIP8ENGINE_THREADED && ctx->blocks == NULL) {
+		ctx->blocks = MALLOC(sizeof(struct chip8_blocks));
+		if (ctx->blocks == NULL)
+			FATALERROR("Couldn't allocate memory!");
+		flush_blocks(ctx);
+	}
+	#else
+	if (engine == CHIP8ENGINE_THREADED) {
+		chip8_set_engine(ctx, CHIP8ENGINE_PREDECODE);
+		return;
+	}
+	#endif
+
+	ctx->engine = engine;
+}
+
+void chip8_tick_timers(struct chip8* const ctx)
+{
+	if (ctx->rgs.dt > 0)
+		--ctx->rgs.dt;
+	if (ctx->rgs.st > 0 && --ctx->rgs.st == 0)
+		log_beep(ctx, ctx->cycles, false);
+}
+
+int chip8_run(struct chip8* const ctx, const int max_cycles,
+              enum Chip8Exit* const reason)
+{
+	const bool clean = ctx->dirty_rows == 0;
+	enum Chip8Exit exit = CHIP8EXIT_BUDGET;
+	int cycles = 0;
+	int n;
+
+	while (cycles < max_cycles) {
+		if (ctx->state == CHIP8STATE_HALTED || ctx->rgs.pc > CHIP8_PC_MAX) {
+			ctx->state = CHIP8STATE_HALTED;
+			break;
+		}
+
+		if (ctx->state == CHIP8STATE_WAITKEY) {
+			if (ctx->keys == 0) {
+				/* idle through the rest of the budget, the timers keep going */
+				ctx->cycles += max_cycles - cycles;
+				ctx->skipped += max_cycles - cycles;
+				cycles = max_cycles;
+				exit = CHIP8EXIT_WAITKEY;
+				break;
+			}
+			resume_key(ctx);
+		}
+
+		n = chip8_idle_loop_length(ctx, ctx->rgs.pc);
+		if (n != 0) {
+			cycles += skip_idle_loop(ctx, n, max_cycles - cycles);
+			continue;
+		}
+
+		switch (ctx->engine) {
+		#ifdef CHIP8_HAVE_JIT
+		case CHIP8ENGINE_JIT:
+			/* the compiled blocks count ctx->cycles themselves */
+			n = chip8_jit_execute(ctx, max_cycles - cycles);
+			break;
+		#endif
+		#ifdef CHIP8_HAVE_THREADED
+		case CHIP8ENGINE_THREADED:
+			n = execute_threaded(ctx, max_cycles - cycles);
+			ctx->cycles += n;
+			break;
+		#endif
+		default:
+			n = 0;
+			break;
+		}
+
+		/* the budget ends inside the next block, so finish it one
+		 * instruction at a time, the run never goes past max_cycles */
+		if (n == 0)
+			n = execute_single(ctx, max_cycles - cycles);
+		cycles += n;
+
+		if (clean && ctx->dirty_rows != 0) {
+			exit = CHIP8EXIT_DRAW;
+			break;
+		}
+	}
+
+	/* a pc past the last whole opcode faults the moment it's set,
+	 * whatever the budget left */
+	if (ctx->rgs.pc > CHIP8_PC_MAX)
+		ctx->state = CHIP8STATE_HALTED;
+
+	if (ctx->state == CHIP8STATE_HALTED)
+		exit = CHIP8EXIT_ERROR;
+
+	chip8_sync_timers(ctx);
+
+	if (reason != NULL)
+		*reason = exit;
+
+	return cycles;
+}
+
+int chip8_step(struct chip8* const ctx)
+{
+	return chip8_run(ctx, 1, NULL);
+}
+
+#ifdef CHIP8_PROFILE
+void chip8_profile_reset(struct chip8* const ctx)
+{
+	memset(&ctx->profile, 0, sizeof ctx->profile);
+}
+
+void chip8_profile_sort(const struct chip8_profile* const prof,
+                        uint8_t order[CHIP8_OPCLASSES])
+{
+	uint8_t i, j, cls;
+
+	for (i = 0; i < CHIP8_OPCLASSES; ++i) {
+		cls = i;
+		for (j = i; j > 0 && prof->ticks[order[j - 1]] < prof->ticks[cls]; --j)
+			order[j] = order[j - 1];
+		order[j] = cls;
+	}
+}
+#endif
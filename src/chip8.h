@@ -3,16 +3,28 @@
 #include "system.h"
 
 
-/* Chip8 draws with res 64x32
- * if the gfx buffer is larger than that
- * the image is centered in the gfx buffer
+/* Chip8 draws with res 64x32, SUPER-CHIP's hires mode with 128x64,
+ * one bit per pixel. row y is gfx[y] packed in two words, the leftmost
+ * pixel in the MSB of gfx[y][0], lores only uses gfx[0..31][0].
+ * chip8_render() expands it to the larger platform gfx buffer, lores
+ * pixels doubled, the image is centered in the gfx buffer.
+ * dirty_rows bit y covers 1/32 of the display, one lores row or
+ * hires rows 2y and 2y + 1
  */
-#define CHIP8_FREQ        (512)
-#define CHIP8_DELAY_FREQ  (120)
-#define CHIP8_GFX_WIDTH   (68)
-#define CHIP8_GFX_HEIGHT  (34)
-#define CHIP8_GFX_BGC     (0x8000)
-#define CHIP8_GFX_FGC     (0xFFFF)
+#define CHIP8_FREQ         (512)
+#define CHIP8_TIMER_FREQ   (60)
+#define CHIP8_LORES_WIDTH  (64)
+#define CHIP8_LORES_HEIGHT (32)
+#define CHIP8_SCR_WIDTH    (128)
+#define CHIP8_SCR_HEIGHT   (64)
+#define CHIP8_GFX_WIDTH    (136)
+#define CHIP8_GFX_HEIGHT   (68)
+#define CHIP8_GFX_BGC      (0x8000)
+#define CHIP8_GFX_FGC      (0xFFFF)
+#define CHIP8_DIRTY_ALL    (0xFFFFFFFFul)
+#define CHIP8_BEEPS        (8)
+#define CHIP8_FLAGS        (8)
+#define CHIP8_PC_MAX       (0x0FFE) /* the last address of a whole opcode */
 
 typedef uint16_t chip8_gfx_t;
 typedef uint16_t chip8_key_t;
@@ -35,10 +47,182 @@ enum Chip8Key {
 	CHIP8KEY_F = 0x8000
 };
 
-void chip8_loadrom(const char* filename);
-void chip8_loadrom_raw(const void* data, short size);
-void chip8_reset(void);
-void chip8_step(void);
+enum Chip8Engine {
+	CHIP8ENGINE_INTERP,    /* fetch and decode every instruction */
+	CHIP8ENGINE_PREDECODE, /* dispatch from a per address decoded op cache */
+	CHIP8ENGINE_THREADED,  /* run basic blocks of direct threaded code */
+	CHIP8ENGINE_JIT        /* compile basic blocks to native code */
+};
+
+/* what the vm is doing between chip8_run() calls */
+enum Chip8State {
+	CHIP8STATE_RUNNING,
+	CHIP8STATE_WAITKEY, /* Fx0A, resumes once keys is non zero, the host can sleep */
+	CHIP8STATE_HALTED   /* unknown opcode, stack fault or pc past CHIP8_PC_MAX */
+};
+
+/* why chip8_run() returned */
+enum Chip8Exit {
+	CHIP8EXIT_BUDGET,  /* max_cycles were executed */
+	CHIP8EXIT_DRAW,    /* the display got damaged, it was clean on entry */
+	CHIP8EXIT_WAITKEY, /* Fx0A waits for a key, the rest of the budget idled */
+	CHIP8EXIT_ERROR    /* the vm is CHIP8STATE_HALTED */
+};
+
+#if defined(CHIP8_PROFILE)
+/* builds with CHIP8_PROFILE defined count every executed instruction
+ * by opcode class, along with the host ticks (the TSC where there is
+ * one) spent in its handler. the block engines then fall back to
+ * CHIP8ENGINE_PREDECODE, and the skipped iterations of idle loops
+ * aren't counted. without it none of this exists
+ */
+#define CHIP8_OPCLASSES (44)
+
+struct chip8_profile {
+	uint64_t count[CHIP8_OPCLASSES];
+	uint64_t ticks[CHIP8_OPCLASSES];
+};
+
+/* "8xy4", "Dxyn", ... indexed like the counters */
+extern const char* const chip8_opclass_names[CHIP8_OPCLASSES];
+#endif
+
+/* the buzzer going on as ST rises above 0, or off as it drops to 0 */
+struct chip8_beep {
+	uint32_t cycle;
+	bool on;
+};
+
+struct chip8_op;
+struct chip8_blocks;
+struct chip8_jit;
+
+/* all the state of one chip8 machine,
+ * instances are independent of each other
+ */
+struct chip8 {
+	struct {
+		uint16_t pc;
+		uint16_t i;
+		int8_t   sp;
+		uint8_t  v[0x10];
+		uint8_t  dt;
+		uint8_t  st;
+	} rgs;
+
+	uint16_t stack[16];
+	uint8_t ram[0x1000];
+	uint64_t gfx[CHIP8_SCR_HEIGHT][2];
+	bool hires;            /* 00FF 128x64 mode, 00FE goes back to 64x32 */
+	uint8_t flags[CHIP8_FLAGS]; /* Fx75/Fx85 RPL user flags, kept across resets */
+	chip8_key_t keys;
+	uint32_t dirty_rows;   /* bit y set when row y, 2y and 2y + 1 in hires, changed since the last render */
+	enum Chip8State state;
+	uint8_t wait_reg;      /* the Vx of the Fx0A being waited on */
+	uint32_t cycles;       /* instructions emulated since reset, skipped ones included */
+	uint32_t skipped;      /* of cycles, the ones idle loops and Fx0A waits were fast-forwarded through */
+	uint32_t timer_cycles; /* cycles when DT/ST were last brought up to date */
+	uint32_t timer_acc;    /* progress toward the next DT/ST tick, in CHIP8_FREQ units */
+	bool host_timers;      /* DT/ST only tick through chip8_tick_timers() */
+	uint32_t seed;         /* Cxkk's sequence restarts from it on reset */
+	uint32_t rng;          /* xorshift32 state, never 0 */
+	/* the buzzer changes since the host last took them, which it does
+	 * by reading them and zeroing nbeeps. once full the last one is
+	 * overwritten, so the newest change is never lost
+	 */
+	struct chip8_beep beeps[CHIP8_BEEPS];
+	uint8_t nbeeps;
+	bool beeping;          /* ST was above 0 as of timer_cycles */
+
+	enum Chip8Engine engine;
+	struct chip8_op* ops;
+	struct chip8_blocks* blocks;
+	struct chip8_jit* jit;
+
+	#if defined(CHIP8_PROFILE)
+	struct chip8_profile profile; /* kept across resets */
+	#endif
+};
+
+
+#define CHIP8_STATE_MAGIC   (0x38504843ul) /* "CHP8" */
+#define CHIP8_STATE_VERSION (4)
+
+/* snapshot of everything that defines a running vm, the layout is fixed
+ * and has no padding so it can be memcpy'd, written or mapped as is.
+ * the version changes whenever the layout does
+ */
+struct chip8_state {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	uint16_t pc;
+	uint16_t i;
+	int8_t   sp;
+	uint8_t  dt;
+	uint8_t  st;
+	uint8_t  state;
+	uint8_t  wait_reg;
+	uint8_t  host_timers;
+	uint8_t  v[0x10];
+	uint16_t keys;
+	uint16_t stack[16];
+	uint32_t cycles;
+	uint32_t timer_cycles;
+	uint32_t timer_acc;
+	uint32_t seed;
+	uint32_t rng;
+	uint32_t skipped;
+	uint8_t  flags[CHIP8_FLAGS];
+	uint8_t  hires;
+	uint8_t  pad[3];   /* keeps gfx 8 byte aligned */
+	uint8_t  ram[0x1000];
+	uint64_t gfx[CHIP8_SCR_HEIGHT][2];
+};
+
+
+struct chip8* chip8_create(void);
+void chip8_destroy(struct chip8* ctx);
+void chip8_loadrom(struct chip8* ctx, const char* filename);
+void chip8_loadrom_raw(struct chip8* ctx, const void* data, short size);
+void chip8_reset(struct chip8* ctx);
+/* redraws only the damaged rows into pixels, the borders are only
+ * filled when every row is dirty (after reset, or forced by the host
+ * setting dirty_rows to CHIP8_DIRTY_ALL). returns the rendered rows
+ * mask and clears it
+ */
+uint32_t chip8_render(struct chip8* ctx,
+                      chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH]);
+void chip8_set_engine(struct chip8* ctx, enum Chip8Engine engine);
+/* seeds the vm's own random generator, the same seed and input
+ * reproduce a run exactly. chip8_create() seeds with 0
+ */
+void chip8_seed(struct chip8* ctx, uint32_t seed);
+void chip8_save_state(const struct chip8* ctx, struct chip8_state* state);
+/* returns false, leaving ctx untouched, when state isn't a snapshot
+ * of this version or holds registers no vm could have
+ */
+bool chip8_load_state(struct chip8* ctx, const struct chip8_state* state);
+/* decrements DT and ST once, meant for hosts which set host_timers
+ * and tick the timers on their own frame boundary
+ */
+void chip8_tick_timers(struct chip8* ctx);
+/* executes up to max_cycles instructions in one go, never more, with
+ * every engine. returns the number of cycles emulated, the fast-forwarded
+ * ones counted in ctx->skipped included. reason may be NULL
+ */
+int chip8_run(struct chip8* ctx, int max_cycles, enum Chip8Exit* reason);
+/* executes the next instruction, returns the number of
+ * instructions executed
+ */
+int chip8_step(struct chip8* ctx);
+
+#if defined(CHIP8_PROFILE)
+void chip8_profile_reset(struct chip8* ctx);
+/* fills order with the opcode classes, the most ticks first */
+void chip8_profile_sort(const struct chip8_profile* prof,
+                        uint8_t order[CHIP8_OPCLASSES]);
+#endif
 
 
 #endif /* PSCHIP8_CHIP8_H_ */
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE /* memfd_create() */
+#include "chip8jit.h"
+#ifdef CHIP8_HAVE_JIT
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/* The compiled code keeps the chip8 context in rbx, the remaining
+ * instruction budget in r12 and the pc -> code entry table in r14.
+ * Guest registers stay in the context struct. Every block starts by
+ * checking the budget covers all of its instructions, otherwise it
+ * stores its own pc and leaves, so blocks can jump straight into each
+ * other and a run never goes past its budget.
+ * The arena is mapped twice, the code is emitted through a writable
+ * view and runs from an executable one, so compiling never changes
+ * the protection of the pages. Jumps within the arena are relative and
+ * the same in both views, only the entries handed out are executable.
+ */
+#define ARENA_SIZE        (256 * 1024)
+#define BLOCK_MAX_INSTRS  (32)
+#define BLOCK_MAX_BYTES   (BLOCK_MAX_INSTRS * 64 + 64)
+#define MAX_LINKS         (1024)
+
+#define OFF_PC     offsetof(struct chip8, rgs.pc)
+#define OFF_I      offsetof(struct chip8, rgs.i)
+#define OFF_SP     offsetof(struct chip8, rgs.sp)
+#define OFF_V(x)   (offsetof(struct chip8, rgs.v) + (x))
+#define OFF_DT     offsetof(struct chip8, rgs.dt)
+#define OFF_ST     offsetof(struct chip8, rgs.st)
+#define OFF_STACK  offsetof(struct chip8, stack)
+#define OFF_KEYS   offsetof(struct chip8, keys)
+#define OFF_STATE  offsetof(struct chip8, state)
+#define OFF_WAITX  offsetof(struct chip8, wait_reg)
+#define OFF_CYCLES offsetof(struct chip8, cycles)
+
+enum Reg { REG_EAX = 0, REG_ECX = 1 };
+
+enum Cond {
+	COND_E = 0x84, COND_NE = 0x85, COND_A = 0x87,
+	COND_L = 0x8C, COND_GE = 0x8D
+};
+
+typedef long (*jit_enter_fn)(struct chip8* ctx, const void* code,
+                             long budget, void* const* entry);
+
+/* jump into a block that was not compiled yet */
+struct jit_link {
+	uint8_t* site;
+	uint16_t target;
+};
+
+struct chip8_jit {
+	uint8_t* arena;     /* the writable view */
+	uint8_t* exec;      /* the executable view */
+	uint8_t* ptr;
+	uint8_t* code_start;
+	uint8_t* exit;
+	jit_enter_fn enter;
+	void* entry[0x1000];  /* in the executable view */
+	uint8_t code_map[0x1000];
+	struct jit_link links[MAX_LINKS];
+	int nlinks;
+};
+
+
+static void* exec_addr(const struct chip8_jit* const jit, uint8_t* const code)
+{
+	return jit->exec + (code - jit->arena);
+}
+
+static uint8_t* write_addr(const struct chip8_jit* const jit, void* const code)
+{
+	return jit->arena + ((uint8_t*)code - jit->exec);
+}
+
+static void emit8(struct chip8_jit* const jit, const uint8_t b)
+{
+	*jit->ptr++ = b;
+}
+
+static void emit16(struct chip8_jit* const jit, const uint16_t w)
+{
+	memcpy(jit->ptr, &w, 2);
+	jit->ptr += 2;
+}
+
+static void emit32(struct chip8_jit* const jit, const uint32_t d)
+{
+	memcpy(jit->ptr, &d, 4);
+	jit->ptr += 4;
+}
+
+static void emit64(struct chip8_jit* const jit, const uint64_t q)
+{
+	memcpy(jit->ptr, &q, 8);
+	jit->ptr += 8;
+}
+
+/* opc reg, [rbx + disp] */
+static void emit_rm(struct chip8_jit* const jit, const uint8_t opc,
+                    const uint8_t reg, const uint32_t disp)
+{
+	emit8(jit, opc);
+	if (disp < 0x80) {
+		emit8(jit, 0x40|(reg<<3)|0x03);
+		emit8(jit, disp);
+	} else {
+		emit8(jit, 0x80|(reg<<3)|0x03);
+		emit32(jit, disp);
+	}
+}
+
+static void patch_rel32(uint8_t* const site, const uint8_t* const target)
+{
+	const int32_t rel = target - (site + 4);
+	memcpy(site, &rel, 4);
+}
+
+static uint8_t* emit_jmp(struct chip8_jit* const jit)
+{
+	uint8_t* site;
+	emit8(jit, 0xE9);
+	site = jit->ptr;
+	emit32(jit, 0);
+	return site;
+}
+
+static uint8_t* emit_jcc(struct chip8_jit* const jit, const enum Cond cc)
+{
+	uint8_t* site;
+	emit8(jit, 0x0F);
+	emit8(jit, cc);
+	site = jit->ptr;
+	emit32(jit, 0);
+	return site;
+}
+
+static void emit_exit(struct chip8_jit* const jit)
+{
+	patch_rel32(emit_jmp(jit), jit->exit);
+}
+
+static void emit_store_pc(struct chip8_jit* const jit, const uint16_t pc)
+{
+	emit8(jit, 0x66);
+	emit_rm(jit, 0xC7, 0, OFF_PC);
+	emit16(jit, pc);
+}
+
+/* fn(ctx, opcode), the stack is 16 byte aligned inside the blocks */
+static void emit_call(struct chip8_jit* const jit, const void* const fn,
+                      const uint16_t opcode)
+{
+	emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xDF); /* mov rdi, rbx */
+	emit8(jit, 0xBE); emit32(jit, opcode);               /* mov esi, opcode */
+	emit8(jit, 0x48); emit8(jit, 0xB8);                  /* mov rax, imm64 */
+	emit64(jit, (uint64_t)(uintptr_t)fn);
+	emit8(jit, 0xFF); emit8(jit, 0xD0);                  /* call rax */
+}
+
+/* calls back into the interpreter for one opcode */
+static void emit_helper(struct chip8_jit* const jit, const uint16_t opcode)
+{
+	emit_call(jit, (const void*)(uintptr_t)&chip8_exec_opcode, opcode);
+}
+
+/* jumps to the block at target, directly when it is already compiled */
+static void emit_link(struct chip8_jit* const jit, const uint16_t target)
+{
+	uint8_t* const site = emit_jmp(jit);
+
+	if (target <= 0x0FFF && jit->entry[target] != NULL) {
+		patch_rel32(site, write_addr(jit, jit->entry[target]));
+		return;
+	}
+
+	patch_rel32(site, jit->ptr);
+	emit_store_pc(jit, target);
+	emit_exit(jit);
+
+	if (target <= 0x0FFF && jit->nlinks < MAX_LINKS) {
+		jit->links[jit->nlinks].site = site;
+		jit->links[jit->nlinks].target = target;
+		++jit->nlinks;
+	}
+}
+
+/* jumps to the block at the pc in eax, looked up at run time */
+static void emit_indirect(struct chip8_jit* const jit)
+{
+	emit8(jit, 0x66);
+	emit_rm(jit, 0x89, REG_EAX, OFF_PC);                 /* mov [pc], ax */
+	emit8(jit, 0x3D); emit32(jit, CHIP8_PC_MAX);         /* cmp eax, 0xFFE */
+	patch_rel32(emit_jcc(jit, COND_A), jit->exit);
+	emit8(jit, 0x49); emit8(jit, 0x8B);                  /* mov rcx, [r14+rax*8] */
+	emit8(jit, 0x0C); emit8(jit, 0xC6);
+	emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC9); /* test rcx, rcx */
+	patch_rel32(emit_jcc(jit, COND_E), jit->exit);
+	emit8(jit, 0xFF); emit8(jit, 0xE1);                  /* jmp rcx */
+}
+
+/* continues at next + 2 when the flags match cc, at next otherwise */
+static void emit_skip(struct chip8_jit* const jit, const enum Cond cc,
+                      const uint16_t next)
+{
+	uint8_t* const site = emit_jcc(jit, cc);
+	emit_link(jit, next);
+	patch_rel32(site, jit->ptr);
+	emit_link(jit, next + 2);
+}
+
+/* ends the block through the interpreter, which reports the fault */
+static void emit_unknown(struct chip8_jit* const jit,
+                         const uint16_t opcode, const uint16_t next)
+{
+	emit_store_pc(jit, next);
+	emit_helper(jit, opcode);
+	emit_exit(jit);
+}
+
+static void emit_alu(struct chip8_jit* const jit, const uint16_t opcode,
+                     const uint16_t next)
+{
+	const uint8_t x = (opcode>>8)&0x0F;
+	const uint8_t y = (opcode>>4)&0x0F;
+
+	switch (opcode&0x0F) {
+	default:
+		emit_unknown(jit, opcode, next);
+		break;
+	case 0x00:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(x));
+		break;
+	case 0x01:
+	case 0x02:
+	case 0x03: {
+		static const uint8_t opcs[] = { 0x08, 0x20, 0x30 };
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, opcs[(opcode&0x0F) - 1], REG_EAX, OFF_V(x));
+		break;
+	}
+	case 0x04:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit_rm(jit, 0x02, REG_EAX, OFF_V(y));          /* add al, vy */
+		emit8(jit, 0x0F); emit8(jit, 0x92); emit8(jit, 0xC0); /* setc al */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(0x0F));
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, 0x00, REG_EAX, OFF_V(x));          /* add vx, al */
+		break;
+	case 0x05:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit_rm(jit, 0x3A, REG_EAX, OFF_V(y));          /* cmp al, vy */
+		emit8(jit, 0x0F); emit8(jit, 0x97); emit8(jit, 0xC0); /* seta al */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(0x0F));
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, 0x28, REG_EAX, OFF_V(x));          /* sub vx, al */
+		break;
+	case 0x06:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit8(jit, 0x24); emit8(jit, 0x01);             /* and al, 1 */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(0x0F));
+		emit_rm(jit, 0xD0, 5, OFF_V(x));                /* shr vx, 1 */
+		break;
+	case 0x07:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, 0x3A, REG_EAX, OFF_V(x));          /* cmp al, vx */
+		emit8(jit, 0x0F); emit8(jit, 0x97); emit8(jit, 0xC0); /* seta al */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(0x0F));
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(y));
+		emit_rm(jit, 0x2A, REG_EAX, OFF_V(x));          /* sub al, vx */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(x));
+		break;
+	case 0x0E:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit8(jit, 0xC0); emit8(jit, 0xE8); emit8(jit, 0x07); /* shr al, 7 */
+		emit_rm(jit, 0x88, REG_EAX, OFF_V(0x0F));
+		emit_rm(jit, 0xD0, 4, OFF_V(x));                /* shl vx, 1 */
+		break;
+	}
+}
+
+/* emits one instruction, returns true when it ends the block */
+static bool emit_instr(struct chip8_jit* const jit, const uint16_t opcode,
+                       const uint16_t next)
+{
+	const uint8_t x = (opcode>>8)&0x0F;
+	const uint8_t y = (opcode>>4)&0x0F;
+	const uint8_t kk = opcode&0xFF;
+	const uint16_t nnn = opcode&0x0FFF;
+	uint8_t* site;
+
+	switch (opcode>>12) {
+	case 0x00:
+		if (opcode == 0x00E0 || (opcode&0xFFF0) == 0x00C0 ||
+		    opcode == 0x00FB || opcode == 0x00FC ||
+		    opcode == 0x00FE || opcode == 0x00FF) {
+			/* draws leave, chip8_run() may have to stop after them */
+			emit_helper(jit, opcode);
+			emit_store_pc(jit, next);
+			emit_exit(jit);
+			return true;
+		} else if (opcode == 0x00EE) {
+			emit_rm(jit, 0x80, 7, OFF_SP); emit8(jit, 15); /* cmp sp, 15 */
+			site = emit_jcc(jit, COND_GE);
+			emit_rm(jit, 0xFE, 0, OFF_SP);              /* inc sp */
+			emit8(jit, 0x0F);
+			emit_rm(jit, 0xBE, REG_EAX, OFF_SP);        /* movsx eax, sp */
+			emit8(jit, 0x0F); emit8(jit, 0xB7);         /* movzx eax, stack[eax] */
+			emit8(jit, 0x84); emit8(jit, 0x43); emit32(jit, OFF_STACK);
+			emit_indirect(jit);
+			patch_rel32(site, jit->ptr);
+			emit_unknown(jit, opcode, next);
+			return true;
+		}
+		emit_unknown(jit, opcode, next);
+		return true;
+	case 0x01:
+		emit_link(jit, nnn);
+		return true;
+	case 0x02:
+		emit_rm(jit, 0x80, 7, OFF_SP); emit8(jit, 0);       /* cmp sp, 0 */
+		site = emit_jcc(jit, COND_L);
+		emit8(jit, 0x0F);
+		emit_rm(jit, 0xBE, REG_EAX, OFF_SP);                /* movsx eax, sp */
+		emit8(jit, 0x66); emit8(jit, 0xC7);                 /* mov stack[eax], next */
+		emit8(jit, 0x84); emit8(jit, 0x43); emit32(jit, OFF_STACK);
+		emit16(jit, next);
+		emit_rm(jit, 0xFE, 1, OFF_SP);                      /* dec sp */
+		emit_link(jit, nnn);
+		patch_rel32(site, jit->ptr);
+		emit_unknown(jit, opcode, next);
+		return true;
+	case 0x03:
+		emit_rm(jit, 0x80, 7, OFF_V(x)); emit8(jit, kk);    /* cmp vx, kk */
+		emit_skip(jit, COND_E, next);
+		return true;
+	case 0x04:
+		emit_rm(jit, 0x80, 7, OFF_V(x)); emit8(jit, kk);
+		emit_skip(jit, COND_NE, next);
+		return true;
+	case 0x05:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit_rm(jit, 0x3A, REG_EAX, OFF_V(y));
+		emit_skip(jit, COND_E, next);
+		return true;
+	case 0x06:
+		emit_rm(jit, 0xC6, 0, OFF_V(x)); emit8(jit, kk);    /* mov vx, kk */
+		return false;
+	case 0x07:
+		emit_rm(jit, 0x80, 0, OFF_V(x)); emit8(jit, kk);    /* add vx, kk */
+		return false;
+	case 0x08:
+		emit_alu(jit, opcode, next);
+		return (opcode&0x0F) > 0x07 && (opcode&0x0F) != 0x0E;
+	case 0x09:
+		emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+		emit_rm(jit, 0x3A, REG_EAX, OFF_V(y));
+		emit_skip(jit, COND_NE, next);
+		return true;
+	case 0x0A:
+		emit8(jit, 0x66);
+		emit_rm(jit, 0xC7, 0, OFF_I); emit16(jit, nnn);     /* mov i, nnn */
+		return false;
+	case 0x0B:
+		emit8(jit, 0x0F);
+		emit_rm(jit, 0xB6, REG_EAX, OFF_V(0));              /* movzx eax, v0 */
+		emit8(jit, 0x05); emit32(jit, nnn);                 /* add eax, nnn */
+		emit_indirect(jit);
+		return true;
+	case 0x0C:
+		emit_helper(jit, opcode);
+		return false;
+	case 0x0D:
+		emit_helper(jit, opcode);
+		emit_store_pc(jit, next);
+		emit_exit(jit);
+		return true;
+	case 0x0E:
+		if (kk != 0x9E && kk != 0xA1)
+			return false;
+		emit8(jit, 0x0F);
+		emit_rm(jit, 0xB6, REG_ECX, OFF_V(x));              /* movzx ecx, vx */
+		emit8(jit, 0xB8); emit32(jit, 1);                   /* mov eax, 1 */
+		emit8(jit, 0xD3); emit8(jit, 0xE0);                 /* shl eax, cl */
+		emit8(jit, 0x66);
+		emit_rm(jit, 0x85, REG_EAX, OFF_KEYS);              /* test keys, ax */
+		emit_skip(jit, kk == 0x9E ? COND_NE : COND_E, next);
+		return true;
+	case 0x0F:
+		switch (kk) {
+		case 0x07:
+			emit_rm(jit, 0x8A, REG_EAX, OFF_DT);
+			emit_rm(jit, 0x88, REG_EAX, OFF_V(x));
+			return false;
+		case 0x0A:
+			emit8(jit, 0x66);
+			emit_rm(jit, 0xC7, 0, OFF_KEYS); emit16(jit, 0);
+			emit_rm(jit, 0xC6, 0, OFF_WAITX); emit8(jit, x);
+			emit_rm(jit, 0xC7, 0, OFF_STATE); emit32(jit, CHIP8STATE_WAITKEY);
+			emit_store_pc(jit, next);
+			emit_exit(jit);
+			return true;
+		case 0x15:
+		case 0x18:
+			emit_rm(jit, 0x8A, REG_EAX, OFF_V(x));
+			emit_rm(jit, 0x88, REG_EAX, kk == 0x15 ? OFF_DT : OFF_ST);
+			return false;
+		case 0x1E:
+			emit8(jit, 0x0F);
+			emit_rm(jit, 0xB6, REG_EAX, OFF_V(x));
+			emit8(jit, 0x66);
+			emit_rm(jit, 0x01, REG_EAX, OFF_I);             /* add i, ax */
+			return false;
+		case 0x29:
+			emit8(jit, 0x0F);
+			emit_rm(jit, 0xB6, REG_EAX, OFF_V(x));
+			emit8(jit, 0x8D); emit8(jit, 0x04); emit8(jit, 0x80); /* lea eax, [rax+rax*4] */
+			emit8(jit, 0x66);
+			emit_rm(jit, 0x89, REG_EAX, OFF_I);
+			return false;
+		case 0x33:
+		case 0x55:
+			/* the write may flush the code cache, never chain from here */
+			emit_helper(jit, opcode);
+			emit_store_pc(jit, next);
+			emit_exit(jit);
+			return true;
+		case 0x30:
+		case 0x65:
+		case 0x75:
+		case 0x85:
+			emit_helper(jit, opcode);
+			return false;
+		default:
+			emit_unknown(jit, opcode, next);
+			return true;
+		}
+	}
+
+	return true;
+}
+
+static void flush(struct chip8_jit* const jit)
+{
+	jit->ptr = jit->code_start;
+	jit->nlinks = 0;
+	memset(jit->entry, 0, sizeof jit->entry);
+	memset(jit->code_map, 0, sizeof jit->code_map);
+}
+
+static bool is_timer_op(const uint16_t opcode)
+{
+	switch (opcode&0xF0FF) {
+	case 0xF007: case 0xF015: case 0xF018: return true;
+	default: return false;
+	}
+}
+
+static void* compile_block(struct chip8* const ctx, uint16_t pc)
+{
+	struct chip8_jit* const jit = ctx->jit;
+	const uint16_t start = pc;
+	uint8_t* code;
+	uint8_t* ninstrs_imm[3];
+	uint16_t opcode;
+	int ninstrs = 0;
+	int len;
+	int i;
+
+	if ((jit->arena + ARENA_SIZE) - jit->ptr < BLOCK_MAX_BYTES)
+		flush(jit);
+
+	code = jit->ptr;
+
+	/* idle loops are fast forwarded by chip8_run(), just leave */
+	len = chip8_idle_loop_length(ctx, pc);
+	if (len != 0) {
+		memset(&jit->code_map[pc], 1, len * 2);
+		emit_store_pc(jit, start);
+		emit_exit(jit);
+		goto done;
+	}
+
+	/* cmp r12, ninstrs; jge body; store pc; exit; body: sub r12, ninstrs */
+	emit8(jit, 0x49); emit8(jit, 0x83); emit8(jit, 0xFC);
+	ninstrs_imm[2] = jit->ptr;
+	emit8(jit, 0);
+	emit8(jit, 0x7D); emit8(jit, 0x0B);
+	emit_store_pc(jit, start);
+	emit_exit(jit);
+	emit8(jit, 0x49); emit8(jit, 0x83); emit8(jit, 0xEC);
+	ninstrs_imm[0] = jit->ptr;
+	emit8(jit, 0);
+
+	/* a timer opcode can only be first, sync while cycles is exact */
+	if (is_timer_op((ctx->ram[pc]<<8)|ctx->ram[pc + 1]))
+		emit_call(jit, (const void*)(uintptr_t)&chip8_sync_timers, 0);
+
+	/* add dword [cycles], ninstrs */
+	emit_rm(jit, 0x83, 0, OFF_CYCLES);
+	ninstrs_imm[1] = jit->ptr;
+	emit8(jit, 0);
+
+	for (;;) {
+		/* chip8_run() faults on a pc past the last whole opcode */
+		if (pc > CHIP8_PC_MAX) {
+			emit_link(jit, pc);
+			break;
+		}
+
+		opcode = (ctx->ram[pc]<<8)|ctx->ram[pc + 1];
+		jit->code_map[pc] = jit->code_map[pc + 1] = 1;
+
+		/* timer opcodes start their own block, see update_dt_st */
+		if (ninstrs > 0 && is_timer_op(opcode)) {
+			emit_link(jit, pc);
+			break;
+		}
+
+		pc += 2;
+		++ninstrs;
+
+		if (emit_instr(jit, opcode, pc))
+			break;
+
+		if (ninstrs == BLOCK_MAX_INSTRS) {
+			emit_link(jit, pc);
+			break;
+		}
+	}
+
+	*ninstrs_imm[0] = *ninstrs_imm[1] = *ninstrs_imm[2] = ninstrs;
+
+done:
+	jit->entry[start] = exec_addr(jit, code);
+
+	/* chain the blocks which were waiting for this one */
+	for (i = 0; i < jit->nlinks; ++i) {
+		if (jit->links[i].target == start) {
+			patch_rel32(jit->links[i].site, code);
+			jit->links[i--] = jit->links[--jit->nlinks];
+		}
+	}
+
+	return jit->entry[start];
+}
+
+
+struct chip8_jit* chip8_jit_create(void)
+{
+	struct chip8_jit* const jit = MALLOC(sizeof(struct chip8_jit));
+	int fd;
+
+	if (jit == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	fd = memfd_create("chip8jit", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, ARENA_SIZE) != 0)
+		FATALERROR("Couldn't create JIT arena");
+
+	jit->arena = mmap(NULL, ARENA_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	jit->exec = mmap(NULL, ARENA_SIZE, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+	close(fd);
+	if (jit->arena == MAP_FAILED || jit->exec == MAP_FAILED)
+		FATALERROR("Couldn't map JIT arena");
+
+	jit->ptr = jit->arena;
+
+	/* exit: return the remaining budget */
+	jit->exit = jit->ptr;
+	emit8(jit, 0x4C); emit8(jit, 0x89); emit8(jit, 0xE0); /* mov rax, r12 */
+	emit8(jit, 0x41); emit8(jit, 0x5F);                   /* pop r15 */
+	emit8(jit, 0x41); emit8(jit, 0x5E);                   /* pop r14 */
+	emit8(jit, 0x41); emit8(jit, 0x5D);                   /* pop r13 */
+	emit8(jit, 0x41); emit8(jit, 0x5C);                   /* pop r12 */
+	emit8(jit, 0x5B);                                     /* pop rbx */
+	emit8(jit, 0xC3);                                     /* ret */
+
+	/* enter(ctx, code, budget, entry) */
+	jit->enter = (jit_enter_fn)(uintptr_t)exec_addr(jit, jit->ptr);
+	emit8(jit, 0x53);                                     /* push rbx */
+	emit8(jit, 0x41); emit8(jit, 0x54);                   /* push r12 */
+	emit8(jit, 0x41); emit8(jit, 0x55);                   /* push r13 */
+	emit8(jit, 0x41); emit8(jit, 0x56);                   /* push r14 */
+	emit8(jit, 0x41); emit8(jit, 0x57);                   /* push r15 */
+	emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xFB); /* mov rbx, rdi */
+	emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xD4); /* mov r12, rdx */
+	emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xCE); /* mov r14, rcx */
+	emit8(jit, 0xFF); emit8(jit, 0xE6);                   /* jmp rsi */
+
+	jit->code_start = jit->ptr;
+	flush(jit);
+	return jit;
+}
+
+void chip8_jit_destroy(struct chip8_jit* const jit)
+{
+	munmap(jit->exec, ARENA_SIZE);
+	munmap(jit->arena, ARENA_SIZE);
+	FREE(jit);
+}
+
+/* any write over compiled code drops the whole cache, the block
+ * doing the write always leaves right after it
+ */
+void chip8_jit_invalidate(struct chip8_jit* const jit,
+                          const uint16_t addr, const uint16_t end)
+{
+	uint16_t i;
+	for (i = addr; i < end; ++i) {
+		if (jit->code_map[i]) {
+			flush(jit);
+			return;
+		}
+	}
+}
+
+/* runs compiled blocks until the next one doesn't fit in the budget or a
+ * block leaves, returns the instructions executed
+ */
+int chip8_jit_execute(struct chip8* const ctx, const int budget)
+{
+	struct chip8_jit* const jit = ctx->jit;
+	void* code = jit->entry[ctx->rgs.pc];
+
+	if (code == NULL)
+		code = compile_block(ctx, ctx->rgs.pc);
+
+	return budget - jit->enter(ctx, code, budget, jit->entry);
+}
+
+#endif
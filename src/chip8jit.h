@@ -0,0 +1,26 @@
+#ifndef PSCHIP8_CHIP8JIT_H_ /* PSCHIP8_CHIP8JIT_H_ */
+#define PSCHIP8_CHIP8JIT_H_
+#include "chip8.h"
+
+
+/* native x86-64 block compiler, only available on linux hosts
+ * and left out of CHIP8_PROFILE builds
+ */
+#if defined(__x86_64__) && defined(__linux__) && !defined(CHIP8_PROFILE)
+#define CHIP8_HAVE_JIT
+
+struct chip8_jit* chip8_jit_create(void);
+void chip8_jit_destroy(struct chip8_jit* jit);
+void chip8_jit_invalidate(struct chip8_jit* jit, uint16_t addr, uint16_t end);
+int chip8_jit_execute(struct chip8* ctx, int budget);
+#endif
+
+/* interpreter entries used by the compiled code for the complex opcodes,
+ * chip8.c defines them in every build so they're always declared
+ */
+void chip8_exec_opcode(struct chip8* ctx, uint16_t opcode);
+void chip8_sync_timers(struct chip8* ctx);
+int chip8_idle_loop_length(const struct chip8* ctx, uint16_t pc);
+
+
+#endif /* PSCHIP8_CHIP8JIT_H_ */
@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "system.h"
+#include "chip8.h"
+#include "movie.h"
+
+
+struct rom {
+	char name[64];
+	uint8_t data[0x1000 - 0x200];
+	short size;
+	uint64_t steps;
+	uint64_t executed;
+	uint64_t nsec;
+};
+
+struct check {
+	long frame;
+	uint64_t hash;
+};
+
+struct run {
+	struct rom* rom;
+	const struct movie* movie;
+	int idx;
+	uint64_t steps;
+	uint64_t executed;  /* steps not fast-forwarded through idle loops */
+	uint64_t hash;
+	uint64_t nsec;
+	struct check* checks;
+	int nchecks;
+	bool halted;
+	bool resumed;
+};
+
+/* an expected frame hash, or an executed/s baseline when idx and frame are -1 */
+struct golden {
+	char rom[64];
+	int idx;
+	long frame;
+	uint64_t hash;
+	double rate;
+};
+
+
+static struct run* runs;
+static int nruns;
+static int next_run;
+static long steps_per_run = 1000000;
+static enum Chip8Engine engine = CHIP8ENGINE_INTERP;
+static const char* state_dir = NULL;
+static struct movie** movies = NULL;
+static int nmovies = 0;
+static uint32_t seed = 0;
+static long check_frames = 60;
+static bool checking = false;
+#if defined(CHIP8_PROFILE)
+static struct chip8_profile profile;
+#endif
+
+static const char* const engine_names[] = {
+	[CHIP8ENGINE_INTERP]    = "interp",
+	[CHIP8ENGINE_PREDECODE] = "predecode",
+	[CHIP8ENGINE_THREADED]  = "threaded",
+	[CHIP8ENGINE_JIT]       = "jit"
+};
+
+
+static void usage(const char* const prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-v vms_per_rom] [-n steps_per_vm] [-t threads]\n"
+	        "          [-e interp|predecode|threaded|jit] [-s state_dir]\n"
+	        "          [-p movie]... [-r seed] [-f frames] [-w golden | -c golden]\n"
+	        "          [-b baseline] [rom...]\n"
+	        "  with no rom arguments every data/*.CH8 is run\n"
+	        "  with -s each vm resumes from and saves to state_dir/ROM.VM.state\n"
+	        "  with -p the vms of the rom a movie was recorded with replay it\n"
+	        "  vm N is seeded with seed + N, replays use the movie's seed\n"
+	        "  -w writes the framebuffer hash every -f frames (60) and the\n"
+	        "  executed instructions/s of each rom to golden, -c compares\n"
+	        "  against it. idle loops skipped over aren't executed\n"
+	        "  with -b the executed instructions/s go to or come from baseline\n",
+	        prog);
+	exit(EXIT_FAILURE);
+}
+
+static enum Chip8Engine parse_engine(const char* const name)
+{
+	for (size_t i = 0; i < sizeof(engine_names)/sizeof(engine_names[0]); ++i) {
+		if (strcmp(name, engine_names[i]) == 0)
+			return i;
+	}
+
+	FATALERROR("Unknown engine %s", name);
+	return CHIP8ENGINE_INTERP;
+}
+
+static void read_rom(struct rom* const rom, const char* const path)
+{
+	const char* const slash = strrchr(path, '/');
+	FILE* const file = fopen(path, "rb");
+
+	if (file == NULL)
+		FATALERROR("Couldn't open file %s", path);
+
+	rom->size = fread(rom->data, 1, sizeof rom->data, file);
+	fclose(file);
+
+	if (rom->size <= 0)
+		FATALERROR("Couldn't read file %s", path);
+
+	snprintf(rom->name, sizeof rom->name, "%s", slash ? slash + 1 : path);
+	rom->steps = 0;
+	rom->executed = 0;
+	rom->nsec = 0;
+}
+
+static struct movie* read_movie(const char* const path)
+{
+	FILE* const file = fopen(path, "rb");
+	struct movie* mv;
+	uint8_t* data;
+	long size;
+
+	if (file == NULL)
+		FATALERROR("Couldn't open file %s", path);
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = MALLOC(size > 0 ? size : 1);
+	size = fread(data, 1, size, file);
+	fclose(file);
+
+	mv = movie_decode(data, size);
+	FREE(data);
+	if (mv == NULL)
+		FATALERROR("Couldn't decode movie %s", path);
+
+	return mv;
+}
+
+static const struct movie* find_movie(const struct chip8* const vm)
+{
+	for (int i = 0; i < nmovies; ++i) {
+		if (movie_matches(movies[i], vm))
+			return movies[i];
+	}
+	return NULL;
+}
+
+static int romcmp(const void* const a, const void* const b)
+{
+	return strcmp(((const struct rom*)a)->name, ((const struct rom*)b)->name);
+}
+
+/* FNV-1a over the words of the framebuffer the mode displays,
+ * lores hashes the same as before hires existed
+ */
+static uint64_t hash_gfx(const struct chip8* const vm)
+{
+	const int height = vm->hires ? CHIP8_SCR_HEIGHT : CHIP8_LORES_HEIGHT;
+	const size_t size = vm->hires ? sizeof vm->gfx[0] : sizeof vm->gfx[0][0];
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (int y = 0; y < height; ++y) {
+		const uint8_t* const p = (const uint8_t*)vm->gfx[y];
+		for (size_t i = 0; i < size; ++i) {
+			hash ^= p[i];
+			hash *= 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
+
+/* cycle count at the end of a 60 Hz frame */
+static uint32_t frame_cycles(const long frame)
+{
+	return ((uint64_t)frame * CHIP8_FREQ) / CHIP8_TIMER_FREQ;
+}
+
+static void* worker(void* const arg)
+{
+	int idx;
+	while ((idx = __atomic_fetch_add(&next_run, 1, __ATOMIC_RELAXED)) < nruns) {
+		struct run* const run = &runs[idx];
+		struct chip8* const vm = chip8_create();
+
+		struct chip8_state* state = NULL;
+		char path[256];
+		uint32_t next_event = 0;
+
+		chip8_set_engine(vm, engine);
+		chip8_loadrom_raw(vm, run->rom->data, run->rom->size);
+		chip8_reset(vm);
+		run->movie = find_movie(vm);
+		chip8_seed(vm, run->movie != NULL ? run->movie->seed : seed + run->idx);
+
+		if (state_dir != NULL) {
+			snprintf(path, sizeof path, "%s/%s.%d.state",
+			         state_dir, run->rom->name, run->idx);
+			state = map_file(path, sizeof(struct chip8_state));
+			run->resumed = chip8_load_state(vm, state);
+		}
+
+		/* the checked frames are absolute, so resumed runs line up */
+		long frame = 0;
+		uint32_t frame_end = UINT32_MAX;
+		run->nchecks = 0;
+		run->checks = NULL;
+		if (checking) {
+			run->checks = MALLOC(sizeof(struct check) *
+			                     (steps_per_run / frame_cycles(check_frames) + 1));
+			do {
+				frame += check_frames;
+				frame_end = frame_cycles(frame);
+			} while (frame_end <= vm->cycles);
+		}
+
+		enum Chip8Exit reason = CHIP8EXIT_BUDGET;
+		long steps = 0;
+		int budget;
+		const uint32_t skipped = vm->skipped;
+		const uint64_t start = get_nsec_now();
+		while (steps < steps_per_run && reason != CHIP8EXIT_ERROR) {
+			budget = steps_per_run - steps;
+			if (frame_end - vm->cycles < (uint32_t)budget)
+				budget = frame_end - vm->cycles;
+			if (run->movie != NULL)
+				budget = movie_play(run->movie, &next_event, vm, budget);
+			steps += chip8_run(vm, budget, &reason);
+
+			if (checking && vm->cycles == frame_end) {
+				run->checks[run->nchecks].frame = frame;
+				run->checks[run->nchecks].hash = hash_gfx(vm);
+				++run->nchecks;
+				frame += check_frames;
+				frame_end = frame_cycles(frame);
+			}
+		}
+		run->nsec = get_nsec_now() - start;
+		run->steps = steps;
+		run->executed = steps - (vm->skipped - skipped);
+		run->halted = reason == CHIP8EXIT_ERROR;
+
+		run->hash = hash_gfx(vm);
+
+		if (state != NULL) {
+			chip8_save_state(vm, state);
+			unmap_file(state, sizeof(struct chip8_state));
+		}
+
+		#if defined(CHIP8_PROFILE)
+		for (int i = 0; i < CHIP8_OPCLASSES; ++i) {
+			__atomic_add_fetch(&profile.count[i], vm->profile.count[i], __ATOMIC_RELAXED);
+			__atomic_add_fetch(&profile.ticks[i], vm->profile.ticks[i], __ATOMIC_RELAXED);
+		}
+		#endif
+
+		chip8_destroy(vm);
+	}
+
+	return NULL;
+}
+
+#if defined(CHIP8_PROFILE)
+/* the opcode mix of every run, the classes costing the most first */
+static void print_profile(void)
+{
+	uint8_t order[CHIP8_OPCLASSES];
+	uint64_t count = 0, ticks = 0;
+
+	for (int i = 0; i < CHIP8_OPCLASSES; ++i) {
+		count += profile.count[i];
+		ticks += profile.ticks[i];
+	}
+
+	chip8_profile_sort(&profile, order);
+	printf("\n%-6s %16s %7s %18s %7s %10s\n",
+	       "OPCODE", "count", "count%", "ticks", "ticks%", "ticks/op");
+	for (int i = 0; i < CHIP8_OPCLASSES; ++i) {
+		const int cls = order[i];
+		if (profile.count[cls] == 0)
+			continue;
+		printf("%-6s %16llu %6.2f%% %18llu %6.2f%% %10.1f\n",
+		       chip8_opclass_names[cls],
+		       (unsigned long long)profile.count[cls],
+		       profile.count[cls] * 100.0 / count,
+		       (unsigned long long)profile.ticks[cls],
+		       profile.ticks[cls] * 100.0 / ticks,
+		       (double)profile.ticks[cls] / profile.count[cls]);
+	}
+}
+#endif
+
+/* executed instructions per second, the skipped ones cost next to nothing */
+static double rom_rate(const struct rom* const rom)
+{
+	return rom->executed * 1e9 / (rom->nsec ? rom->nsec : 1);
+}
+
+/* one "ROM VM FRAME HASH" line per checked frame, then one
+ * "ROM rate EXECUTED_PER_SEC" line per rom, in baseline when it's set
+ */
+static void write_golden(const char* const path, const char* const baseline,
+                         const struct rom* const roms, const int nroms)
+{
+	FILE* const file = fopen(path, "w");
+	FILE* rates;
+	if (file == NULL)
+		FATALERROR("Couldn't open file %s", path);
+
+	fprintf(file, "# %ld steps per vm, hash every %ld frames\n",
+	        steps_per_run, check_frames);
+	for (int i = 0; i < nruns; ++i) {
+		for (int j = 0; j < runs[i].nchecks; ++j) {
+			fprintf(file, "%s %d %ld %016llx\n",
+			        runs[i].rom->name, runs[i].idx, runs[i].checks[j].frame,
+			        (unsigned long long)runs[i].checks[j].hash);
+		}
+	}
+
+	rates = baseline != NULL ? fopen(baseline, "w") : file;
+	if (rates == NULL)
+		FATALERROR("Couldn't open file %s", baseline);
+	for (int i = 0; i < nroms; ++i)
+		fprintf(rates, "%s rate %.0f\n", roms[i].name, rom_rate(&roms[i]));
+
+	if (rates != file)
+		fclose(rates);
+	fclose(file);
+	LOGINFO("Wrote golden values to %s", path);
+}
+
+static int goldencmp(const void* const a, const void* const b)
+{
+	const struct golden* const ga = a;
+	const struct golden* const gb = b;
+	const int c = strcmp(ga->rom, gb->rom);
+	if (c != 0)
+		return c;
+	if (ga->idx != gb->idx)
+		return ga->idx < gb->idx ? -1 : 1;
+	if (ga->frame != gb->frame)
+		return ga->frame < gb->frame ? -1 : 1;
+	return 0;
+}
+
+/* sorted for goldencmp() lookups, the rates have idx and frame -1 */
+static struct golden* read_golden(const char* const path, int* const count)
+{
+	FILE* const file = fopen(path, "r");
+	struct golden* golden = NULL;
+	struct golden g;
+	unsigned long long hash;
+	char line[256];
+	int n = 0;
+
+	if (file == NULL)
+		FATALERROR("Couldn't open file %s", path);
+
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (sscanf(line, "%63s %d %ld %llx", g.rom, &g.idx, &g.frame, &hash) == 4) {
+			g.hash = hash;
+		} else if (sscanf(line, "%63s rate %lf", g.rom, &g.rate) == 2) {
+			g.idx = -1;
+			g.frame = -1;
+		} else {
+			continue;
+		}
+		golden = REALLOC(golden, sizeof(struct golden) * (n + 1));
+		golden[n++] = g;
+	}
+
+	fclose(file);
+	qsort(golden, n, sizeof(struct golden), goldencmp);
+	*count = n;
+	return golden;
+}
+
+/* every checked frame must match, frames the golden file doesn't
+ * have fail too. the rates, from baseline when it's set, are only
+ * reported, they depend on the host
+ */
+static bool check_golden(const char* const path, const char* const baseline,
+                         const struct rom* const roms, const int nroms)
+{
+	int ngolden, nrates;
+	struct golden* const golden = read_golden(path, &ngolden);
+	struct golden* const rates = baseline != NULL ? read_golden(baseline, &nrates) : golden;
+	const struct golden* expected;
+	struct golden key;
+	int failed = 0;
+	int checked = 0;
+
+	for (int i = 0; i < nruns; ++i) {
+		const struct run* const run = &runs[i];
+		snprintf(key.rom, sizeof key.rom, "%s", run->rom->name);
+		key.idx = run->idx;
+		for (int j = 0; j < run->nchecks; ++j) {
+			const struct check* const check = &run->checks[j];
+			key.frame = check->frame;
+			expected = bsearch(&key, golden, ngolden,
+			                   sizeof(struct golden), goldencmp);
+
+			++checked;
+			if (expected == NULL) {
+				printf("MISSING %s vm %d frame %ld\n",
+				       run->rom->name, run->idx, check->frame);
+				++failed;
+			} else if (expected->hash != check->hash) {
+				printf("FAILED  %s vm %d frame %ld: hash %016llx, expected %016llx\n",
+				       run->rom->name, run->idx, check->frame,
+				       (unsigned long long)check->hash,
+				       (unsigned long long)expected->hash);
+				++failed;
+			}
+		}
+	}
+
+	printf("\n%-14s %16s %16s %8s\n", "ROM", "executed/s/core", "baseline", "ratio");
+	key.idx = -1;
+	key.frame = -1;
+	for (int i = 0; i < nroms; ++i) {
+		snprintf(key.rom, sizeof key.rom, "%s", roms[i].name);
+		expected = bsearch(&key, rates, rates != golden ? nrates : ngolden,
+		                   sizeof(struct golden), goldencmp);
+		if (expected != NULL) {
+			printf("%-14s %16.0f %16.0f %7.2fx\n", roms[i].name,
+			       rom_rate(&roms[i]), expected->rate,
+			       rom_rate(&roms[i]) / expected->rate);
+		}
+	}
+
+	printf("\n%d of %d frames match %s\n", checked - failed, checked, path);
+	if (rates != golden)
+		FREE(rates);
+	FREE(golden);
+	return failed == 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int vms_per_rom = 4;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* golden_out = NULL;
+	const char* golden_in = NULL;
+	const char* baseline = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:n:t:e:s:p:r:f:w:c:b:h")) != -1) {
+		switch (opt) {
+		case 'v': vms_per_rom = atoi(optarg); break;
+		case 'n': steps_per_run = atol(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'e': engine = parse_engine(optarg); break;
+		case 's': state_dir = optarg; break;
+		case 'p':
+			movies = REALLOC(movies, sizeof(struct movie*) * (nmovies + 1));
+			movies[nmovies++] = read_movie(optarg);
+			break;
+		case 'r': seed = strtoul(optarg, NULL, 0); break;
+		case 'f': check_frames = atol(optarg); break;
+		case 'w': golden_out = optarg; break;
+		case 'c': golden_in = optarg; break;
+		case 'b': baseline = optarg; break;
+		default: usage(argv[0]); break;
+		}
+	}
+
+	if (vms_per_rom < 1 || steps_per_run < 1 || steps_per_run > INT_MAX ||
+	    nthreads < 1 || check_frames < 1 || (golden_out && golden_in) ||
+	    (baseline && !golden_out && !golden_in))
+		usage(argv[0]);
+
+	checking = golden_out != NULL || golden_in != NULL;
+
+	int nroms;
+	struct rom* roms;
+	if (optind < argc) {
+		nroms = argc - optind;
+		roms = MALLOC(sizeof(struct rom) * nroms);
+		for (int i = 0; i < nroms; ++i)
+			read_rom(&roms[i], argv[optind + i]);
+	} else {
+		const struct game_list* const gamelist = open_game_list();
+		if (gamelist == NULL || gamelist->size == 0)
+			FATALERROR("No roms found in data/");
+
+		char path[256];
+		nroms = gamelist->size;
+		roms = MALLOC(sizeof(struct rom) * nroms);
+		for (int i = 0; i < nroms; ++i) {
+			snprintf(path, sizeof path, "data/%s", gamelist->files[i]);
+			read_rom(&roms[i], path);
+		}
+		close_game_list(gamelist);
+		qsort(roms, nroms, sizeof(struct rom), romcmp);
+	}
+
+	nruns = nroms * vms_per_rom;
+	runs = MALLOC(sizeof(struct run) * nruns);
+	for (int i = 0; i < nruns; ++i) {
+		runs[i].rom = &roms[i / vms_per_rom];
+		runs[i].idx = i % vms_per_rom;
+		runs[i].resumed = false;
+	}
+
+	if (nthreads > nruns)
+		nthreads = nruns;
+
+	LOGINFO("%d roms, %d vms per rom, %ld steps per vm, %d threads, %s engine",
+	        nroms, vms_per_rom, steps_per_run, nthreads, engine_names[engine]);
+
+	pthread_t* const threads = MALLOC(sizeof(pthread_t) * nthreads);
+	const uint64_t start = get_nsec_now();
+	for (int i = 0; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			FATALERROR("Couldn't create worker thread");
+	}
+	for (int i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	const uint64_t wall_nsec = get_nsec_now() - start;
+
+	uint64_t total_steps = 0;
+	uint64_t total_executed = 0;
+	for (int i = 0; i < nruns; ++i) {
+		struct run* const run = &runs[i];
+		run->rom->steps += run->steps;
+		run->rom->executed += run->executed;
+		run->rom->nsec += run->nsec;
+		total_steps += run->steps;
+		total_executed += run->executed;
+		printf("%-14s vm %-4d %12.0f executed/s  hash %016llx%s%s%s\n",
+		       run->rom->name, run->idx,
+		       run->executed * 1e9 / (run->nsec ? run->nsec : 1),
+		       (unsigned long long)run->hash,
+		       run->resumed ? "  resumed" : "",
+		       run->movie != NULL ? "  replayed" : "",
+		       run->halted ? "  halted" : "");
+	}
+
+	printf("\n%-14s %14s %14s %16s\n", "ROM", "steps", "executed", "executed/s/core");
+	for (int i = 0; i < nroms; ++i) {
+		printf("%-14s %14llu %14llu %16.0f\n", roms[i].name,
+		       (unsigned long long)roms[i].steps,
+		       (unsigned long long)roms[i].executed, rom_rate(&roms[i]));
+	}
+
+	printf("\ntotal: %llu steps, %llu executed and %llu skipped in %.3f s,\n"
+	       "       %.0f executed/s with %d threads\n",
+	       (unsigned long long)total_steps, (unsigned long long)total_executed,
+	       (unsigned long long)(total_steps - total_executed), wall_nsec / 1e9,
+	       total_executed * 1e9 / (wall_nsec ? wall_nsec : 1), nthreads);
+
+	#if defined(CHIP8_PROFILE)
+	print_profile();
+	#endif
+
+	bool passed = true;
+	if (golden_out != NULL)
+		write_golden(golden_out, baseline, roms, nroms);
+	else if (golden_in != NULL)
+		passed = check_golden(golden_in, baseline, roms, nroms);
+
+	for (int i = 0; i < nruns; ++i)
+		FREE(runs[i].checks);
+	for (int i = 0; i < nmovies; ++i)
+		movie_destroy(movies[i]);
+	FREE(movies);
+	FREE(threads);
+	FREE(runs);
+	FREE(roms);
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "system.h"
+
+
+void load_files(const char* const* const filenames,
+                void** const dsts, const short nfiles)
+{
+	char namebuffer[256];
+	for (short i = 0; i < nfiles; ++i) {
+		snprintf(namebuffer, sizeof namebuffer, "data/%s", filenames[i]);
+		FILE* const file = fopen(namebuffer, "rb");
+
+		if (file == NULL)
+			FATALERROR("Couldn't open file %s", namebuffer);
+
+		fseek(file, 0, SEEK_END);
+		const long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		if (dsts[i] == NULL) {
+			dsts[i] = MALLOC(size);
+			if (dsts[i] == NULL)
+				FATALERROR("Couldn't allocate memory!");
+		}
+
+		if (fread(dsts[i], 1, size, file) != (size_t)size)
+			FATALERROR("Couldn't read file %s", namebuffer);
+
+		fclose(file);
+	}
+}
+
+const struct game_list* open_game_list(void)
+{
+	DIR* const dir = opendir("data/");
+	if (dir == NULL) {
+		LOGERROR("Couldn't opendir data/");
+		return NULL;
+	}
+
+	uint8_t size = 0;
+	uint8_t bufsize = 32;
+	char** files = MALLOC(sizeof(char*) * bufsize);
+	if (files == NULL) {
+		LOGERROR("Couldn't allocate mem");
+		closedir(dir);
+		return NULL;
+	}
+
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL) {
+		const int len = strlen(ent->d_name);
+		if (len > 4 && strcmp(&ent->d_name[len - 4], ".CH8") == 0) {
+			if (size >= bufsize) {
+				bufsize += 32;
+				files = REALLOC(files, sizeof(char*) * bufsize);
+			}
+			files[size] = MALLOC(len + 1);
+			strcpy(files[size], ent->d_name);
+			size += 1;
+		}
+	}
+
+	closedir(dir);
+	struct game_list* gamelist = MALLOC(sizeof(struct game_list));
+	gamelist->files = (const char* const*)files;
+	gamelist->size = size;
+	return gamelist;
+}
+
+void close_game_list(const struct game_list* const gamelist)
+{
+	for (int i = 0; i < gamelist->size; ++i)
+		FREE((char*)gamelist->files[i]);
+	FREE((char**)gamelist->files);
+	FREE((struct game_list*)gamelist);
+}
+
+static void sys_logaux(const char* const cat, const char* const fmt, va_list ap)
+{
+	fprintf(stderr, "%s: ", cat);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+}
+
+void* map_file(const char* const path, const size_t size)
+{
+	const int fd = open(path, O_RDWR|O_CREAT, 0644);
+	void* p;
+
+	if (fd < 0)
+		FATALERROR("Couldn't open file %s", path);
+
+	if (ftruncate(fd, size) != 0)
+		FATALERROR("Couldn't resize file %s", path);
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		FATALERROR("Couldn't map file %s", path);
+
+	return p;
+}
+
+void unmap_file(void* const p, const size_t size)
+{
+	munmap(p, size);
+}
+
+void sys_log(const char* const cat, const char* const fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	sys_logaux(cat, fmt, ap);
+	va_end(ap);
+}
+
+void sys_fatalerror(const char* const fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	sys_logaux("[FATAL ERROR]", fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
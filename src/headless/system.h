@@ -0,0 +1,70 @@
+#ifndef PSCHIP8_SYSTEM_H_ /* PSCHIP8_SYSTEM_H_ */
+#define PSCHIP8_SYSTEM_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+
+#define MALLOC(...)  malloc(__VA_ARGS__)
+#define REALLOC(...) realloc(__VA_ARGS__)
+#define FREE(...)    free(__VA_ARGS__)
+
+
+/* logging / crash */
+#define LOGAUX(category, ...)      sys_log(category, __VA_ARGS__)
+#define FATALERROR(...)            sys_fatalerror(__VA_ARGS__)
+#define LOGINFO(...)               LOGAUX("[INFO]", __VA_ARGS__)
+#define LOGERROR(...)              LOGAUX("[ERROR]", __VA_ARGS__)
+
+#ifdef DEBUG /* DEBUG */
+
+#define LOGDEBUG(...) LOGAUX("[DEBUG]", __VA_ARGS__)
+
+#define ASSERT_MSG(cond, ...) {          \
+	if (!(cond))                     \
+		FATALERROR(__VA_ARGS__); \
+}
+
+#else
+
+#define LOGDEBUG(...)   ((void)0)
+#define ASSERT_MSG(...) ((void)0)
+
+#endif /* DEBUG */
+
+
+struct game_list {
+	const char* const* files;
+	uint8_t size;
+};
+
+
+void load_files(const char* const* filenames, void** dsts, short nfiles);
+const struct game_list* open_game_list(void);
+void close_game_list(const struct game_list* gamelist);
+/* shared read/write mapping of the file at path, created and sized
+ * to size bytes if needed, writes land in the file
+ */
+void* map_file(const char* path, size_t size);
+void unmap_file(void* p, size_t size);
+void sys_log(const char* cat, const char* fmt, ...);
+void sys_fatalerror(const char* fmt, ...);
+
+
+/* nanoseconds from the monotonic clock */
+static inline uint64_t get_nsec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000u) + ts.tv_nsec;
+}
+
+static inline uint32_t get_msec_now(void)
+{
+	return get_nsec_now() / 1000000u;
+}
+
+
+#endif /* PSCHIP8_SYSTEM_H_ */
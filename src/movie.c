@@ -0,0 +1,217 @@
+#include <string.h>
+#include "movie.h"
+
+
+#define HEADER_SIZE (20)
+
+
+/* FNV-1a over the program memory */
+static uint32_t hash_rom(const struct chip8* const ctx)
+{
+	uint32_t hash = 0x811C9DC5ul;
+	uint16_t i;
+	for (i = 0x200; i < 0x1000; ++i) {
+		hash ^= ctx->ram[i];
+		hash *= 0x01000193ul;
+	}
+	return hash;
+}
+
+static void put_u16(uint8_t* const out, const uint16_t value)
+{
+	out[0] = value&0xFF;
+	out[1] = value>>8;
+}
+
+static void put_u32(uint8_t* const out, const uint32_t value)
+{
+	put_u16(out, value&0xFFFF);
+	put_u16(out + 2, value>>16);
+}
+
+static uint16_t get_u16(const uint8_t* const in)
+{
+	return in[0]|(in[1]<<8);
+}
+
+static uint32_t get_u32(const uint8_t* const in)
+{
+	return get_u16(in)|((uint32_t)get_u16(in + 2)<<16);
+}
+
+static struct movie* alloc_movie(const uint32_t capacity)
+{
+	struct movie* const mv = MALLOC(sizeof(struct movie));
+	if (mv == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	mv->events = MALLOC(sizeof(struct movie_event) * capacity);
+	if (mv->events == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	mv->nevents = 0;
+	mv->capacity = capacity;
+	return mv;
+}
+
+
+struct movie* movie_create(const struct chip8* const ctx)
+{
+	struct movie* const mv = alloc_movie(256);
+	mv->rom_hash = hash_rom(ctx);
+	mv->seed = ctx->seed;
+	return mv;
+}
+
+struct movie* movie_decode(const void* const data, const uint32_t size)
+{
+	const uint8_t* const in = data;
+	struct movie* mv;
+	uint32_t nevents, pos, cycle, delta, i;
+	uint8_t byte, shift;
+
+	if (size < HEADER_SIZE || get_u32(in) != MOVIE_MAGIC ||
+	    get_u16(in + 4) != MOVIE_VERSION) {
+		LOGERROR("Not a movie of version %d", MOVIE_VERSION);
+		return NULL;
+	}
+
+	nevents = get_u32(in + 16);
+	/* every event takes at least 3 bytes */
+	if (nevents > (size - HEADER_SIZE) / 3) {
+		LOGERROR("Truncated movie");
+		return NULL;
+	}
+
+	mv = alloc_movie(nevents > 0 ? nevents : 1);
+	mv->rom_hash = get_u32(in + 8);
+	mv->seed = get_u32(in + 12);
+
+	pos = HEADER_SIZE;
+	cycle = 0;
+	for (i = 0; i < nevents; ++i) {
+		delta = 0;
+		shift = 0;
+		do {
+			if (pos >= size || shift > 28)
+				goto truncated;
+			byte = in[pos++];
+			delta |= (uint32_t)(byte&0x7F) << shift;
+			shift += 7;
+		} while (byte&0x80);
+
+		if (pos + 2 > size)
+			goto truncated;
+
+		cycle += delta;
+		mv->events[i].cycle = cycle;
+		mv->events[i].keys = get_u16(in + pos);
+		pos += 2;
+	}
+
+	mv->nevents = nevents;
+	return mv;
+
+truncated:
+	LOGERROR("Truncated movie");
+	movie_destroy(mv);
+	return NULL;
+}
+
+void* movie_encode(const struct movie* const mv, uint32_t* const size)
+{
+	/* a varint cycle delta takes at most 5 bytes */
+	uint8_t* const out = MALLOC(HEADER_SIZE + mv->nevents * 7);
+	uint32_t pos, cycle, delta, i;
+
+	if (out == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	put_u32(out, MOVIE_MAGIC);
+	put_u16(out + 4, MOVIE_VERSION);
+	put_u16(out + 6, 0);
+	put_u32(out + 8, mv->rom_hash);
+	put_u32(out + 12, mv->seed);
+	put_u32(out + 16, mv->nevents);
+
+	pos = HEADER_SIZE;
+	cycle = 0;
+	for (i = 0; i < mv->nevents; ++i) {
+		delta = mv->events[i].cycle - cycle;
+		cycle = mv->events[i].cycle;
+		while (delta >= 0x80) {
+			out[pos++] = (delta&0x7F)|0x80;
+			delta >>= 7;
+		}
+		out[pos++] = delta;
+		put_u16(out + pos, mv->events[i].keys);
+		pos += 2;
+	}
+
+	*size = pos;
+	return out;
+}
+
+void movie_destroy(struct movie* const mv)
+{
+	FREE(mv->events);
+	FREE(mv);
+}
+
+bool movie_matches(const struct movie* const mv,
+                   const struct chip8* const ctx)
+{
+	return mv->rom_hash == hash_rom(ctx);
+}
+
+void movie_record(struct movie* const mv, struct chip8* const ctx,
+                  const chip8_key_t keys)
+{
+	struct movie_event* ev;
+
+	if (ctx->keys == keys)
+		return;
+
+	ctx->keys = keys;
+
+	/* changed again before the vm ran, the new keys supersede it */
+	if (mv->nevents > 0 && mv->events[mv->nevents - 1].cycle == ctx->cycles) {
+		mv->events[mv->nevents - 1].keys = keys;
+		return;
+	}
+
+	if (mv->nevents == mv->capacity) {
+		mv->capacity *= 2;
+		mv->events = REALLOC(mv->events,
+		                     sizeof(struct movie_event) * mv->capacity);
+		if (mv->events == NULL)
+			FATALERROR("Couldn't allocate memory!");
+	}
+
+	ev = &mv->events[mv->nevents++];
+	ev->cycle = ctx->cycles;
+	ev->keys = keys;
+}
+
+void movie_truncate(struct movie* const mv, const uint32_t cycle)
+{
+	while (mv->nevents > 0 && mv->events[mv->nevents - 1].cycle >= cycle)
+		--mv->nevents;
+}
+
+int movie_play(const struct movie* const mv, uint32_t* const next,
+               struct chip8* const ctx, const int budget)
+{
+	uint32_t until;
+
+	while (*next < mv->nevents && mv->events[*next].cycle <= ctx->cycles) {
+		ctx->keys = mv->events[*next].keys;
+		++(*next);
+	}
+
+	if (*next == mv->nevents)
+		return budget;
+
+	until = mv->events[*next].cycle - ctx->cycles;
+	return until < (uint32_t)budget ? (int)until : budget;
+}
@@ -0,0 +1,56 @@
+#ifndef PSCHIP8_MOVIE_H_ /* PSCHIP8_MOVIE_H_ */
+#define PSCHIP8_MOVIE_H_
+#include "chip8.h"
+
+
+/* input movie: the vm's keys changes stamped with the emulated cycle
+ * they happened at, so a replay feeds them back at the exact same point
+ * of the emulation regardless of the host's frame rate.
+ * the encoded form is a small header followed by (varint cycle delta,
+ * 16 bit keys) pairs, all little endian
+ */
+#define MOVIE_MAGIC   (0x564D3843ul) /* "C8MV" */
+#define MOVIE_VERSION (2)
+
+struct movie_event {
+	uint32_t cycle;
+	chip8_key_t keys;
+};
+
+struct movie {
+	struct movie_event* events;
+	uint32_t nevents;
+	uint32_t capacity;
+	uint32_t rom_hash;
+	uint32_t seed;     /* the vm's seed when the recording started */
+};
+
+
+/* starts an empty recording for the rom loaded in ctx,
+ * ctx must be freshly reset. a replay must chip8_seed() its vm
+ * with the movie's seed
+ */
+struct movie* movie_create(const struct chip8* ctx);
+/* decodes a movie, returns NULL when data isn't a valid movie */
+struct movie* movie_decode(const void* data, uint32_t size);
+/* returns a MALLOC'd buffer with the encoded movie */
+void* movie_encode(const struct movie* mv, uint32_t* size);
+void movie_destroy(struct movie* mv);
+/* whether mv was recorded with the rom loaded in the freshly reset ctx */
+bool movie_matches(const struct movie* mv, const struct chip8* ctx);
+/* sets ctx->keys, logging the change against ctx->cycles. every host
+ * write to the keys goes through it, the vm itself clearing them on
+ * Fx0A is reproduced by the replay
+ */
+void movie_record(struct movie* mv, struct chip8* ctx, chip8_key_t keys);
+/* drops the events at or after cycle, for hosts rewinding a recording */
+void movie_truncate(struct movie* mv, uint32_t cycle);
+/* sets ctx->keys from the events due at ctx->cycles and returns budget
+ * clamped so chip8_run() stops at the next event. next is the index of
+ * the next event, start it at 0
+ */
+int movie_play(const struct movie* mv, uint32_t* next,
+               struct chip8* ctx, int budget);
+
+
+#endif /* PSCHIP8_MOVIE_H_ */
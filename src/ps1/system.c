@@ -28,6 +28,7 @@
 #define TMPBUFF_FB_Y         (256)
 
 #define SPU_MAX_MALLOC       (24)
+#define INPUT_QUEUE_SIZE     (64) /* power of two */
 
 u_long _ramsize   = 0x00200000; /* force 2 megabytes of RAM */
 u_long _stacksize = 0x00004000; /* force 16 kilobytes of stack */
@@ -37,6 +38,13 @@ bool sys_quit_flag = false;
 
 /* input */
 uint16_t sys_paddata;
+/* single producer single consumer ring, the VSync callback being
+ * the producer. the indexes are only ever written by their owner
+ */
+static struct input_event input_queue[INPUT_QUEUE_SIZE];
+static volatile uint16_t input_head;
+static volatile uint16_t input_tail;
+static button_t input_queued;   /* the pad of the newest change queued */
 
 /* timers */
 uint32_t sys_msec_timer;
@@ -68,10 +76,23 @@ static uint16_t spu_snd_freqs[SPU_MAX_MALLOC];
 static uint8_t spu_malloc[SPU_MALLOC_RECSIZ * (SPU_MAX_MALLOC + 1)];
 
 
+/* a change which doesn't fit is retried on the next VSync */
 static inline void update_pads(void)
 {
 	extern uint16_t sys_paddata;
+	const uint16_t head = input_head;
+
 	sys_paddata = PadRead(0);
+	if (sys_paddata == input_queued ||
+	    (uint16_t)(head - input_tail) == INPUT_QUEUE_SIZE)
+		return;
+
+	input_queue[head&(INPUT_QUEUE_SIZE - 1)].usec = get_usec();
+	input_queue[head&(INPUT_QUEUE_SIZE - 1)].pad = sys_paddata;
+	/* the event must be in memory before the consumer can see it */
+	__asm__ volatile ("" : : : "memory");
+	input_head = head + 1;
+	input_queued = sys_paddata;
 }
 
 static void setup_curr_drawot(void)
@@ -156,6 +177,8 @@ void init_system(void)
 	/* input */
 	PadInit(0);
 	sys_paddata = 0;
+	input_queued = 0;
+	flush_input_events();
 
 	/* timers */
 	reset_timers();
@@ -207,6 +230,24 @@ void update_display(void)
 	setup_curr_drawot();
 }
 
+bool pop_input_event(struct input_event* const ev)
+{
+	const uint16_t tail = input_tail;
+
+	if (tail == input_head)
+		return false;
+
+	*ev = input_queue[tail&(INPUT_QUEUE_SIZE - 1)];
+	__asm__ volatile ("" : : : "memory");
+	input_tail = tail + 1;
+	return true;
+}
+
+void flush_input_events(void)
+{
+	input_tail = input_head;
+}
+
 
 void font_print(const struct vec2* const pos,
                 const char* const fmt,
@@ -300,6 +341,28 @@ void draw_ram_buffer(void)
 	GsSortSprite(&ram_buff_spr, curr_drawot, OTENTRY_SPRITE);
 }
 
+void draw_bars(const struct vec2* const pos,
+               const uint8_t* const heights,
+               const int16_t nbars)
+{
+	GsBOXF bar;
+	int16_t i;
+
+	memset(&bar, 0, sizeof bar);
+	bar.w = 1;
+	bar.r = 255;
+	bar.g = 255;
+	bar.b = 0;
+	for (i = 0; i < nbars; ++i) {
+		if (heights[i] == 0)
+			continue;
+		bar.x = pos->x + i;
+		bar.y = pos->y - heights[i];
+		bar.h = heights[i];
+		GsSortBoxFill(&bar, curr_drawot, OTENTRY_FONT);
+	}
+}
+
 void assign_snd_chan(const uint8_t chan, const uint8_t snd_index)
 {
 	const uint16_t freq = spu_snd_freqs[snd_index];
@@ -424,6 +487,21 @@ void load_ram_buffer(void* const pixels,
 	ram_buff_spr.scaley = ONE * scale;
 }
 
+void load_ram_buffer_rows(const void* const pixels,
+                          const short row, const short nrows)
+{
+	RECT rect;
+
+	rect = (RECT) {
+		.x = TMPBUFF_FB_X,
+		.y = TMPBUFF_FB_Y + row,
+		.w = ram_buff_spr.w,
+		.h = nrows
+	};
+
+	LoadImage(&rect, (void*)(((const uint16_t*)pixels) + (row * ram_buff_spr.w)));
+}
+
 void load_files(const char* const* const filenames, 
                 void** const dsts, 
                 const int16_t nfiles)
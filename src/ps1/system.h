@@ -15,6 +15,7 @@
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
 typedef signed char int8_t;
 typedef signed short int16_t;
 typedef signed int int32_t;
@@ -94,6 +95,12 @@ enum Button {
 };
 
 
+/* a change of the pad, stamped with the get_usec_now() time it happened */
+struct input_event {
+	uint32_t usec;
+	button_t pad;    /* the whole pad after the change */
+};
+
 struct vec2 {
 	int16_t x, y;
 };
@@ -114,10 +121,18 @@ void init_system(void);
 void reset_timers(void);
 void update_timers(void);
 void update_display(void);
+/* the pad changes are queued as they're read, pop_input_event() takes
+ * the oldest one and returns false when there's none. one thread only
+ * may take them, flush_input_events() drops those not taken yet
+ */
+bool pop_input_event(struct input_event* ev);
+void flush_input_events(void);
 
 void font_print(const struct vec2* pos, const char* fmt, const void* const* varpack);
 void draw_sprites(const struct sprite* sprites, short nsprites);
 void draw_ram_buffer(void);
+/* one pixel wide bars standing on pos, left to right */
+void draw_bars(const struct vec2* pos, const uint8_t* heights, short nbars);
 void assign_snd_chan(uint8_t chan, uint8_t snd_index);
 void load_sprite_sheet(void* data, short max_sprites_on_screen);
 void load_bkg(void* data);
@@ -126,9 +141,20 @@ void load_font(void* data, const struct vec2* charsize,
 void load_snd(void* const* data, uint8_t nsnd);
 void load_ram_buffer(void* pixels, const struct vec2* pos,
                      const struct vec2* size, uint8_t scale);
+/* updates rows [row, row + nrows) of the loaded ram buffer,
+ * pixels points to the whole buffer
+ */
+void load_ram_buffer_rows(const void* pixels, short row, short nrows);
 void load_files(const char* const* filenames, void** dsts, short nfiles);
 const struct game_list* open_game_list(void);
 #define close_game_list(...) ((void)0)
+/* nothing to yield to, the VSync paced loop is as idle as it gets */
+#define wait_input(...) (0u)
+/* no voice is given to the chip8 buzzer yet */
+#define set_beeper(...) ((void)0)
+/* the cd is read only, there's no file io outside load_files() */
+#define read_file(...)  (NULL)
+#define write_file(...) (false)
 
 
 static inline void set_chan_volume(const uint8_t chan, const uint16_t vol)
@@ -191,5 +217,11 @@ static inline uint32_t get_usec_now(void)
 	return get_usec();
 }
 
+/* nsec at this precise moment, with usec resolution */
+static inline uint64_t get_nsec_now(void)
+{
+	return (uint64_t)get_usec_now() * 1000u;
+}
+
 
 #endif /* PSCHIP8_SYSTEM_H_ */
@@ -1,6 +1,41 @@
 #include <string.h>
 #include "system.h"
 #include "chip8.h"
+#include "rewind.h"
+#include "movie.h"
+#include "pschip8.h"
+
+
+/* delta ring size, a few minutes of history for most roms */
+#if defined(PLATFORM_SDL2)
+#define REWIND_CAPACITY (256u * 1024u)
+#else
+#define REWIND_CAPACITY (128u * 1024u)
+#endif
+
+/* frames run ahead at most, SELECT & R1 cycles through 0 to it */
+#define RUN_AHEAD_MAX (4)
+
+/* the display is drawn 2x, right below the help text, so hires
+ * pixels are 2x2 and lores ones 4x4. the overlays stay in the bands
+ * above and below it
+ */
+#define DISPLAY_SCALE  (2)
+#define DISPLAY_TOP    (64)
+#define DISPLAY_BOTTOM (DISPLAY_TOP + CHIP8_GFX_HEIGHT * DISPLAY_SCALE)
+
+/* frames in the rolling timing stats and the frame time graph, the
+ * graph is 2 pixels per msec and fills the band below the game
+ */
+#define FRAME_HISTORY (128)
+#define GRAPH_HEIGHT  (SCREEN_HEIGHT - DISPLAY_BOTTOM - 8)
+
+/* opcode classes shown by the profile overlay, below the game
+ * under its title
+ */
+#if defined(CHIP8_PROFILE)
+#define PROFILE_LINES ((SCREEN_HEIGHT - DISPLAY_BOTTOM - 8) / 8 - 1)
+#endif
 
 
 enum Chan {
@@ -29,10 +64,44 @@ enum MenuSprites {
 	MENUSPRT_CROSS 
 };
 
+/* the parts of a run_game() frame timed by the overlay */
+enum FramePhase {
+	PHASE_INPUT,    /* pad to keys */
+	PHASE_EMULATE,  /* chip8_run() or rewind_pop(), then rewind_push(),
+	                 * or taking the emulation thread's frame */
+	PHASE_AHEAD,    /* running ahead and chip8_render() of the frame shown,
+	                 * left to the emulation thread when there's one */
+	PHASE_TEXT,     /* font_print() and draw_bars() */
+	PHASE_UPLOAD,   /* load_ram_buffer_rows() */
+	PHASE_DRAW,     /* draw_ram_buffer() */
+	PHASE_PRESENT,  /* update_display() with the vsync wait, and wait_input() */
+	PHASE_FRAME,    /* all of the above */
+	PHASE_NPHASES
+};
+
+/* usec spent in each phase over the last FRAME_HISTORY frames */
+struct frame_times {
+	uint32_t usec[PHASE_NPHASES][FRAME_HISTORY];
+	int min[PHASE_NPHASES];
+	int avg[PHASE_NPHASES];
+	int p99[PHASE_NPHASES];
+	uint8_t graph[FRAME_HISTORY];
+	uint32_t mark;   /* usec when the last phase ended */
+	short head;      /* the frame being timed */
+	short nframes;
+};
+
 
 
 extern bool sys_quit_flag;
 
+const char* pschip8_movie_path = NULL;
+bool pschip8_movie_replay = false;
+uint8_t pschip8_run_ahead = 0;
+#if defined(PLATFORM_SDL2)
+bool pschip8_emu_thread = false;
+#endif
+
 
 static struct sprite menu_sprites[] = {
 	[MENUSPRT_HAND] = {
@@ -202,15 +271,738 @@ static enum MainMenuOpt main_menu(void)
 	return out[index];
 }
 
+static chip8_key_t pad_to_keys(const button_t pad)
+{
+	chip8_key_t keys = 0;
+	int i;
+
+	for (i = 0; i < sizeof(button_tbl)/sizeof(button_tbl[0]); ++i) {
+		if (pad&button_tbl[i])
+			keys |= 0x01<<i;
+	}
+
+	return keys;
+}
+
+/* starts the movie set by the host for the freshly reset vm */
+static struct movie* open_movie(const struct chip8* const vm)
+{
+	struct movie* mv = NULL;
+	uint32_t size;
+	void* data;
+
+	if (pschip8_movie_path == NULL)
+		return NULL;
+
+	if (!pschip8_movie_replay)
+		return movie_create(vm);
+
+	data = read_file(pschip8_movie_path, &size);
+	if (data == NULL) {
+		LOGERROR("Couldn't read movie %s", pschip8_movie_path);
+		return NULL;
+	}
+
+	mv = movie_decode(data, size);
+	FREE(data);
+	if (mv != NULL && !movie_matches(mv, vm)) {
+		LOGERROR("Movie %s was recorded with another rom", pschip8_movie_path);
+		movie_destroy(mv);
+		mv = NULL;
+	}
+
+	return mv;
+}
+
+static void close_movie(struct movie* const mv)
+{
+	uint32_t size;
+	void* data;
+
+	if (!pschip8_movie_replay) {
+		data = movie_encode(mv, &size);
+		if (write_file(pschip8_movie_path, data, size))
+			LOGINFO("Recorded %lu input changes in %lu bytes to %s",
+			        (unsigned long)mv->nevents, (unsigned long)size,
+			        pschip8_movie_path);
+		else
+			LOGERROR("Couldn't write movie %s", pschip8_movie_path);
+		FREE(data);
+	}
+
+	movie_destroy(mv);
+}
+
+/* host writes to the keys, logged when recording a movie and
+ * dropped when replaying one
+ */
+static void set_keys(struct movie* const mv, struct chip8* const vm,
+                     const chip8_key_t keys)
+{
+	if (mv == NULL)
+		vm->keys = keys;
+	else if (!pschip8_movie_replay)
+		movie_record(mv, vm, keys);
+}
+
+/* replays the movie's keys due before a chip8_run() of budget,
+ * returns the budget clamped to the next change
+ */
+static int movie_budget(struct movie* const mv, uint32_t* const next,
+                        struct chip8* const vm, const int budget)
+{
+	if (mv == NULL || !pschip8_movie_replay)
+		return budget;
+
+	return movie_play(mv, next, vm, budget);
+}
+
+#if defined(CHIP8_PROFILE)
+/* logs every opcode class which ran, the costliest first */
+static void dump_profile(const struct chip8* const vm)
+{
+	const struct chip8_profile* const prof = &vm->profile;
+	uint8_t order[CHIP8_OPCLASSES];
+	uint8_t i, cls;
+
+	chip8_profile_sort(prof, order);
+	LOGINFO("Opcode profile: class, count, ticks, ticks/op");
+	for (i = 0; i < CHIP8_OPCLASSES; ++i) {
+		cls = order[i];
+		if (prof->count[cls] == 0)
+			break;
+		LOGINFO("%s %lu %lu %lu", chip8_opclass_names[cls],
+		        (unsigned long)prof->count[cls],
+		        (unsigned long)prof->ticks[cls],
+		        (unsigned long)(prof->ticks[cls] / prof->count[cls]));
+	}
+}
+
+/* the costliest opcode classes, with their share of the ticks,
+ * left of the frame time graph
+ */
+static void print_profile(const struct chip8* const vm)
+{
+	const struct chip8_profile* const prof = &vm->profile;
+	struct vec2 pos = { 8, DISPLAY_BOTTOM + 4 };
+	uint8_t order[CHIP8_OPCLASSES];
+	uint64_t total = 0;
+	const void* varpack[3];
+	int share, per_op;
+	uint8_t i, cls;
+
+	chip8_profile_sort(prof, order);
+	for (i = 0; i < CHIP8_OPCLASSES; ++i)
+		total += prof->ticks[i];
+
+	font_print(&pos, "Profile: SELECT & SQUARE", NULL);
+	for (i = 0; i < PROFILE_LINES && total > 0; ++i) {
+		cls = order[i];
+		if (prof->count[cls] == 0)
+			break;
+		share = (prof->ticks[cls] * 100u) / total;
+		per_op = prof->ticks[cls] / prof->count[cls];
+		varpack[0] = chip8_opclass_names[cls];
+		varpack[1] = &share;
+		varpack[2] = &per_op;
+		pos.y += 8;
+		font_print(&pos, "%s %d pct, %d ticks/op", varpack);
+	}
+}
+#endif
+
+static void frame_times_reset(struct frame_times* const ft)
+{
+	memset(ft, 0, sizeof(struct frame_times));
+	ft->mark = get_usec_now();
+}
+
+/* charges the time since the last mark to phase */
+static void frame_mark(struct frame_times* const ft, const enum FramePhase phase)
+{
+	const uint32_t now = get_usec_now();
+	ft->usec[phase][ft->head] += now - ft->mark;
+	ft->mark = now;
+}
+
+static void frame_end(struct frame_times* const ft)
+{
+	uint32_t total = 0;
+	short phase;
+
+	for (phase = 0; phase < PHASE_FRAME; ++phase)
+		total += ft->usec[phase][ft->head];
+	ft->usec[PHASE_FRAME][ft->head] = total;
+	ft->graph[ft->head] = total / 500u < GRAPH_HEIGHT ? total / 500u : GRAPH_HEIGHT;
+
+	ft->head = (ft->head + 1) % FRAME_HISTORY;
+	if (ft->nframes < FRAME_HISTORY)
+		++ft->nframes;
+	for (phase = 0; phase < PHASE_NPHASES; ++phase)
+		ft->usec[phase][ft->head] = 0;
+}
+
+/* min, avg and nearest rank p99 of the finished frames */
+static void frame_stats(struct frame_times* const ft)
+{
+	const short n = ft->nframes;
+	uint32_t sorted[FRAME_HISTORY];
+	uint32_t sum, value;
+	short phase, i, j;
+
+	if (n == 0)
+		return;
+
+	for (phase = 0; phase < PHASE_NPHASES; ++phase) {
+		sum = 0;
+		for (i = 0; i < n; ++i) {
+			value = ft->usec[phase][(ft->head + FRAME_HISTORY - 1 - i) % FRAME_HISTORY];
+			sum += value;
+			for (j = i; j > 0 && sorted[j - 1] > value; --j)
+				sorted[j] = sorted[j - 1];
+			sorted[j] = value;
+		}
+		ft->min[phase] = sorted[0];
+		ft->avg[phase] = sum / n;
+		ft->p99[phase] = sorted[(n * 99 + 99) / 100 - 1];
+	}
+}
+
+/* the stats of each phase in usec in two columns above the game,
+ * the frame time graph below it
+ */
+static void print_frame_times(const struct frame_times* const ft)
+{
+	static const char* const names[PHASE_NPHASES] = {
+		"Input   ", "Emulate ", "Ahead   ", "Text    ", "Upload  ",
+		"Draw    ", "Present ", "Frame   "
+	};
+	const struct vec2 graph_pos = {
+		SCREEN_WIDTH - 8 - FRAME_HISTORY, SCREEN_HEIGHT - 4
+	};
+	struct vec2 pos = { 8, 4 };
+	uint8_t bars[FRAME_HISTORY];
+	const void* varpack[4];
+	short phase, i;
+
+	font_print(&pos, "Usec    min avg p99, SELECT & CIRCLE to hide", NULL);
+	for (phase = 0; phase < PHASE_NPHASES; ++phase) {
+		varpack[0] = names[phase];
+		varpack[1] = &ft->min[phase];
+		varpack[2] = &ft->avg[phase];
+		varpack[3] = &ft->p99[phase];
+		/* the second column is 26 characters of the 6 pixel font in */
+		pos.x = phase < PHASE_NPHASES / 2 ? 8 : 8 + 26 * 6;
+		pos.y = 4 + 8 * (1 + phase % (PHASE_NPHASES / 2));
+		font_print(&pos, "%s%d %d %d", varpack);
+	}
+
+	/* oldest frame on the left */
+	for (i = 0; i < FRAME_HISTORY; ++i)
+		bars[i] = ft->graph[(ft->head + i) % FRAME_HISTORY];
+	draw_bars(&graph_pos, bars, FRAME_HISTORY);
+}
+
+/* uploads each run of damaged chip8 rows, a dirty bit covers
+ * two rows of pixels
+ */
+static void upload_dirty_rows(chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH],
+                              uint32_t dirty)
+{
+	const short yoff = (CHIP8_GFX_HEIGHT - CHIP8_SCR_HEIGHT) / 2;
+	short first;
+	short y = 0;
+
+	if (dirty == CHIP8_DIRTY_ALL) {
+		load_ram_buffer_rows(pixels, 0, CHIP8_GFX_HEIGHT);
+		return;
+	}
+
+	while (dirty != 0) {
+		for (; !(dirty&0x01); dirty >>= 1)
+			++y;
+		for (first = y; dirty&0x01; dirty >>= 1)
+			++y;
+		load_ram_buffer_rows(pixels, first * 2 + yoff, (y - first) * 2);
+	}
+}
+
+/* a rom being played and everything tied to it */
+struct game {
+	chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH];
+	struct chip8* vm;
+	struct rewind* rw;
+	struct movie* mv;
+	uint32_t mv_next;
+	struct chip8_state ahead_state;  /* the vm while it runs ahead */
+	enum Chip8Exit reason;
+	struct input_event ev;  /* the next pad change, when has_ev */
+	uint32_t input_usec;    /* when the last frame emulated up to */
+	uint32_t input_base;    /* when the frame's first pad change happened */
+	button_t pad_old;
+	uint8_t ahead;          /* frames shown ahead of the vm */
+	bool has_ev;
+	bool replaying;
+	bool rewinding;
+	bool quit;      /* START & SELECT were pressed */
+};
+
+static void open_game(struct game* const g, const char* const gamepath)
+{
+	g->vm = chip8_create();
+	g->rw = rewind_create(REWIND_CAPACITY);
+	g->mv_next = 0;
+	g->reason = CHIP8EXIT_BUDGET;
+	g->pad_old = 0;
+	g->has_ev = false;
+	g->ahead = pschip8_run_ahead < RUN_AHEAD_MAX ? pschip8_run_ahead : RUN_AHEAD_MAX;
+	g->rewinding = false;
+	g->quit = false;
+
+	chip8_loadrom(g->vm, gamepath);
+	chip8_seed(g->vm, get_msec_now());
+	chip8_reset(g->vm);
+	g->mv = open_movie(g->vm);
+	g->replaying = g->mv != NULL && pschip8_movie_replay;
+	if (g->replaying)
+		chip8_seed(g->vm, g->mv->seed);
+	chip8_render(g->vm, g->pixels);
+
+	/* the changes queued in the menus are over */
+	flush_input_events();
+	g->input_usec = get_usec_now();
+	g->input_base = g->input_usec;
+	set_keys(g->mv, g->vm, pad_to_keys(get_paddata()));
+}
+
+static void close_game(struct game* const g)
+{
+	#if defined(CHIP8_PROFILE)
+	/* the overlay only fits the costliest few */
+	dump_profile(g->vm);
+	#endif
+
+	set_beeper(false, get_usec_now());
+	if (g->mv != NULL)
+		close_movie(g->mv);
+	rewind_destroy(g->rw);
+	chip8_destroy(g->vm);
+}
+
+static bool pressed(const button_t pad, const button_t pad_old, const button_t combo)
+{
+	return (pad&combo) == combo && (pad_old&combo) != combo;
+}
+
+/* the pad combos the host reacts to, the vm's keys follow the queued
+ * pad changes instead
+ */
+static void game_input(struct game* const g, const button_t pad)
+{
+	if (pad == g->pad_old)
+		return;
+
+	if ((pad&BUTTON_START) && (pad&BUTTON_SELECT))
+		g->quit = true;
+
+	if (pressed(pad, g->pad_old, BUTTON_SELECT|BUTTON_R1))
+		g->ahead = (g->ahead + 1) % (RUN_AHEAD_MAX + 1);
+
+	g->pad_old = pad;
+}
+
+/* whether a pad change is waiting to reach the vm, in g->ev */
+static bool input_pending(struct game* const g)
+{
+	if (!g->has_ev)
+		g->has_ev = pop_input_event(&g->ev);
+	return g->has_ev;
+}
+
+/* the frame's first pad change goes in at step 0, so the game sees it
+ * as soon as it would without the queue
+ */
+static void input_begin(struct game* const g, const uint32_t now)
+{
+	if (input_pending(g) && (int32_t)(g->ev.usec - now) <= 0)
+		g->input_base = g->ev.usec;
+	else
+		g->input_base = now;
+}
+
+/* sets the keys of the pad changes due by step i of a frame of budget
+ * steps, which stands for the usecs from g->input_usec to now. the
+ * first change is at step 0 and the later ones keep their spacing from
+ * it, so a press and release between two frames both reach the game
+ * and the key stays down as long as it was held. returns the steps
+ * until the next change
+ */
+static int input_budget(struct game* const g, const uint32_t now,
+                        const int i, const int budget)
+{
+	/* changes older than the frame, after a stall, are squeezed in */
+	const uint32_t span = (int32_t)(g->input_base - g->input_usec) < 0 ?
+	                      now - g->input_base : now - g->input_usec;
+	uint32_t at;
+	int due;
+
+	while (input_pending(g)) {
+		/* happened after now, it's the next frame's */
+		if ((int32_t)(g->ev.usec - now) > 0)
+			break;
+
+		at = g->ev.usec - g->input_base;
+		if ((int32_t)at < 0)
+			at = 0;
+		due = span > 0 ? (int)(((uint64_t)at * budget) / span) : 0;
+		if (due > i)
+			return due - i;
+
+		set_keys(g->mv, g->vm, pad_to_keys(g->ev.pad));
+		g->has_ev = false;
+	}
+
+	return budget - i;
+}
+
+/* hands the buzzer changes of the steps run from cycle to the platform,
+ * spread over the span usecs up to now
+ */
+static void play_beeps(struct chip8* const vm, const uint32_t cycle,
+                       const uint32_t steps, const uint32_t now,
+                       const uint32_t span)
+{
+	const struct chip8_beep* beep;
+	uint32_t at;
+	uint8_t i;
+
+	for (i = 0; i < vm->nbeeps; ++i) {
+		beep = &vm->beeps[i];
+		at = steps > 0 ? (uint32_t)(((uint64_t)(beep->cycle - cycle) * span) / steps) : span;
+		set_beeper(beep->on, now - span + (at < span ? at : span));
+	}
+
+	vm->nbeeps = 0;
+}
+
+/* runs budget steps, or steps back one snapshot while the pad holds
+ * SELECT & TRIANGLE. a faulted guest stays frozen until it's rewound.
+ * returns the steps run
+ */
+static int emulate_frame(struct game* const g, const button_t pad,
+                         const int budget)
+{
+	const uint32_t now = get_usec_now();
+	const uint32_t cycle = g->vm->cycles;
+	int i;
+
+	g->rewinding = !g->replaying &&
+	               (pad&BUTTON_SELECT) && (pad&BUTTON_TRIANGLE);
+	if (g->rewinding) {
+		/* the snapshot brings its own keys which must not
+		 * outlive the rewind */
+		rewind_pop(g->rw, g->vm);
+		/* snapshots are only pushed while the guest runs, so
+		 * one takes the game back from before a fault */
+		if (g->vm->state != CHIP8STATE_HALTED)
+			g->reason = CHIP8EXIT_BUDGET;
+		set_beeper(g->vm->beeping, now);
+		if (g->mv != NULL)
+			movie_truncate(g->mv, g->vm->cycles);
+		while (input_pending(g))
+			g->has_ev = false;
+		g->input_usec = now;
+		set_keys(g->mv, g->vm, pad_to_keys(pad));
+		return 0;
+	}
+
+	input_begin(g, now);
+	for (i = 0; i < budget && g->reason != CHIP8EXIT_ERROR;) {
+		i += chip8_run(g->vm,
+		               movie_budget(g->mv, &g->mv_next, g->vm,
+		                            input_budget(g, now, i, budget)),
+		               &g->reason);
+	}
+
+	/* the changes at the very end of the frame */
+	input_budget(g, now, budget, budget);
+	play_beeps(g->vm, cycle, i, now, now - g->input_usec);
+	g->input_usec = now;
+
+	if (g->reason != CHIP8EXIT_ERROR)
+		rewind_push(g->rw, g->vm);
+
+	return i;
+}
+
+/* renders the vm as it'll be g->ahead frames of budget steps from now
+ * if the keys stay held, then brings it back. the snapshot loaded back
+ * damages the rows the frame shown differs in, so the next render
+ * fixes them up. returns the rendered rows
+ */
+static uint32_t render_ahead(struct game* const g, const int budget)
+{
+	const int ahead = g->ahead * budget;
+	enum Chip8Exit reason = CHIP8EXIT_BUDGET;
+	uint32_t dirty;
+	int i;
+
+	if (ahead == 0 || g->rewinding || g->reason == CHIP8EXIT_ERROR)
+		return g->vm->dirty_rows != 0 ? chip8_render(g->vm, g->pixels) : 0;
+
+	chip8_save_state(g->vm, &g->ahead_state);
+	for (i = 0; i < ahead && reason != CHIP8EXIT_ERROR;)
+		i += chip8_run(g->vm, ahead - i, &reason);
+
+	dirty = g->vm->dirty_rows != 0 ? chip8_render(g->vm, g->pixels) : 0;
+	chip8_load_state(g->vm, &g->ahead_state);
+	return dirty;
+}
+
+static void print_help(const int fps, const int steps,
+                       const int rw_frames, const int rw_kb,
+                       const int ahead, const int ahead_usec)
+{
+	const int rw_kb_max = REWIND_CAPACITY / 1024u;
+	const void* const varpack[] = {
+		&fps, &steps, &rw_frames, &rw_kb, &rw_kb_max, &ahead, &ahead_usec
+	};
+
+	font_print(&(struct vec2){ 8, 8 },
+	           "Press START & SELECT to reset\n"
+	           "Frames per second: %d\n"
+	           "Steps per second: %d\n"
+	           "Hold SELECT & TRIANGLE to rewind\n"
+	           "History: %d frames %d/%d KB\n"
+	           "SELECT & CIRCLE for frame times\n"
+	           "Run-ahead: %d frames %d usec, SELECT & R1", varpack);
+}
+
+#if defined(PLATFORM_SDL2)
+/* marks a middle frame the display hasn't taken yet */
+#define FRAME_FRESH    (0x04)
+#define EMU_TICK_NSEC  (1000000000u / CHIP8_TIMER_FREQ)
+
+/* a finished frame handed from the emulation thread to the display */
+struct frame {
+	chip8_gfx_t pixels[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH];
+	uint32_t dirty;  /* rows changed since the last frame taken */
+	int steps;       /* steps in the last emulated second */
+	int rw_frames;
+	int rw_kb;
+	int ahead;
+	int ahead_usec;  /* spent running ahead and rendering it */
+};
+
+/* the emulation thread fills frames[back] and swaps it with the
+ * middle one flagged FRAME_FRESH, the display swaps its front frame
+ * with a fresh middle. neither side ever waits on the other, and the
+ * display always gets the newest frame
+ */
+struct emu_thread {
+	struct game* game;
+	struct frame frames[3];
+	SDL_atomic_t middle;
+	SDL_atomic_t pad;
+	SDL_atomic_t stop;   /* the display is leaving */
+	SDL_atomic_t done;   /* the game quit or halted */
+	int back;
+	int front;
+	uint32_t pending;    /* rows changed since the last frame taken */
+};
+
+static void publish_frame(struct emu_thread* const et, const uint32_t dirty,
+                          const int steps, const int ahead_usec)
+{
+	struct game* const g = et->game;
+	struct frame* const f = &et->frames[et->back];
+	int old;
+
+	/* once the middle frame was taken the display is only missing
+	 * the rows changed since, a take racing this check just makes
+	 * it upload some rows twice */
+	if (!(SDL_AtomicGet(&et->middle)&FRAME_FRESH))
+		et->pending = 0;
+	et->pending |= dirty;
+
+	memcpy(f->pixels, g->pixels, sizeof f->pixels);
+	f->dirty = et->pending;
+	f->steps = steps;
+	f->rw_frames = g->rw->frames;
+	f->rw_kb = (g->rw->used + 1023u) / 1024u;
+	f->ahead = g->ahead;
+	f->ahead_usec = ahead_usec;
+
+	old = SDL_AtomicSet(&et->middle, et->back|FRAME_FRESH);
+	et->back = old&0x03;
+}
+
+/* the latest fresh frame, or NULL when there's none */
+static struct frame* take_frame(struct emu_thread* const et)
+{
+	if (!(SDL_AtomicGet(&et->middle)&FRAME_FRESH))
+		return NULL;
+
+	et->front = SDL_AtomicSet(&et->middle, et->front)&0x03;
+	return &et->frames[et->front];
+}
+
+/* runs the vm at CHIP8_FREQ paced by the host clock, one tick of
+ * CHIP8_TIMER_FREQ at a time, publishing a frame per tick
+ */
+static int emu_thread_main(void* const arg)
+{
+	struct emu_thread* const et = arg;
+	struct game* const g = et->game;
+	uint64_t start = get_nsec_now();
+	uint64_t deadline, now;
+	uint32_t tick = 0;
+	uint32_t dirty, usec;
+	int steps = 0;
+	int steps_cnt = 0;
+	int budget;
+	button_t pad;
+
+	while (!SDL_AtomicGet(&et->stop)) {
+		pad = SDL_AtomicGet(&et->pad);
+		game_input(g, pad);
+		if (g->quit)
+			break;
+
+		/* CHIP8_FREQ doesn't divide evenly, spread the remainder */
+		budget = ((tick + 1) * CHIP8_FREQ) / CHIP8_TIMER_FREQ -
+		         (tick * CHIP8_FREQ) / CHIP8_TIMER_FREQ;
+		steps_cnt += emulate_frame(g, pad, budget);
+
+		usec = get_usec_now();
+		dirty = render_ahead(g, budget);
+		publish_frame(et, dirty, steps, get_usec_now() - usec);
+
+		if (++tick % CHIP8_TIMER_FREQ == 0) {
+			steps = steps_cnt;
+			steps_cnt = 0;
+		}
+
+		/* a stall longer than a few ticks is dropped, not caught up */
+		deadline = start + (uint64_t)tick * EMU_TICK_NSEC;
+		now = get_nsec_now();
+		if (now < deadline)
+			SDL_Delay((deadline - now) / 1000000u);
+		else if (now - deadline > 4u * EMU_TICK_NSEC)
+			start = now - (uint64_t)tick * EMU_TICK_NSEC;
+	}
+
+	SDL_AtomicSet(&et->done, 1);
+	return 0;
+}
+
+/* run_game() with the vm on its own thread, the display only
+ * uploads and presents the frames it publishes
+ */
+static void run_game_threaded(const char* const gamepath)
+{
+	static struct game game;
+	static struct emu_thread et;
+	static struct frame_times frame_times;
+
+	const struct vec2 pos = {
+		(SCREEN_WIDTH / 2), DISPLAY_TOP + (CHIP8_GFX_HEIGHT * DISPLAY_SCALE) / 2
+	};
+	const struct vec2 size = { CHIP8_GFX_WIDTH, CHIP8_GFX_HEIGHT };
+
+	struct frame* f;
+	SDL_Thread* thread;
+	uint32_t timer = 0;
+	uint32_t last_sec = 0;
+	int steps = 0;
+	int fps = 0;
+	int fps_cnt = 0;
+	button_t pad_old = 0;
+	button_t pad;
+	bool show_times = false;
+	int i;
+
+	open_game(&game, gamepath);
+	load_ram_buffer(game.pixels, &pos, &size, DISPLAY_SCALE);
+
+	et.game = &game;
+	for (i = 0; i < 3; ++i) {
+		memcpy(et.frames[i].pixels, game.pixels, sizeof game.pixels);
+		et.frames[i].dirty = 0;
+	}
+	et.back = 0;
+	SDL_AtomicSet(&et.middle, 1);
+	et.front = 2;
+	et.pending = 0;
+	SDL_AtomicSet(&et.pad, get_paddata());
+	SDL_AtomicSet(&et.stop, 0);
+	SDL_AtomicSet(&et.done, 0);
+
+	thread = SDL_CreateThread(emu_thread_main, "emulation", &et);
+	if (thread == NULL)
+		FATALERROR("%s", SDL_GetError());
+
+	reset_timers();
+	frame_times_reset(&frame_times);
+	while (!sys_quit_flag && !SDL_AtomicGet(&et.done)) {
+		pad = get_paddata();
+		if (pressed(pad, pad_old, BUTTON_SELECT|BUTTON_CIRCLE))
+			show_times = !show_times;
+		pad_old = pad;
+		SDL_AtomicSet(&et.pad, pad);
+		frame_mark(&frame_times, PHASE_INPUT);
+
+		timer = get_msec();
+		f = take_frame(&et);
+		if (f != NULL)
+			steps = f->steps;
+		frame_mark(&frame_times, PHASE_EMULATE);
+
+		if (show_times)
+			print_frame_times(&frame_times);
+		else
+			print_help(fps, steps, et.frames[et.front].rw_frames,
+			           et.frames[et.front].rw_kb, et.frames[et.front].ahead,
+			           et.frames[et.front].ahead_usec);
+		frame_mark(&frame_times, PHASE_TEXT);
+
+		if (f != NULL && f->dirty != 0)
+			upload_dirty_rows(f->pixels, f->dirty);
+		frame_mark(&frame_times, PHASE_UPLOAD);
+
+		draw_ram_buffer();
+		frame_mark(&frame_times, PHASE_DRAW);
+
+		update_display();
+		frame_mark(&frame_times, PHASE_PRESENT);
+		frame_end(&frame_times);
+
+		++fps_cnt;
+		if ((timer - last_sec) >= 1000u) {
+			fps = fps_cnt;
+			fps_cnt = 0;
+			last_sec = timer;
+			frame_stats(&frame_times);
+		}
+	}
+
+	SDL_AtomicSet(&et.stop, 1);
+	SDL_WaitThread(thread, NULL);
+	close_game(&game);
+}
+#endif
+
 static void run_game(const char* const gamepath)
 {
-	extern chip8_gfx_t chip8_gfx[CHIP8_GFX_HEIGHT][CHIP8_GFX_WIDTH];
-	extern chip8_key_t chip8_keys;
-	extern bool chip8_draw_flag;
+	static struct game game;
+	static struct frame_times frame_times;
 
-	const struct vec2 pos = { (SCREEN_WIDTH / 2), (SCREEN_HEIGHT / 2) };
+	const struct vec2 pos = {
+		(SCREEN_WIDTH / 2), DISPLAY_TOP + (CHIP8_GFX_HEIGHT * DISPLAY_SCALE) / 2
+	};
 	const struct vec2 size = { CHIP8_GFX_WIDTH, CHIP8_GFX_HEIGHT };
 
+	struct game* const g = &game;
 	uint32_t timer = 0;
 	uint32_t last_sec = 0;
 	int steps = 0;
@@ -219,54 +1011,100 @@ static void run_game(const char* const gamepath)
 	int fps_cnt = 0;
 	int32_t steps_per_frame = 0;
 	int32_t steps_leftouver = 0;
-	const void* const varpack[] = { &fps, &steps };
 	button_t pad_old = 0;
 	button_t pad;
+	uint32_t slept, dirty, cycle;
+	bool show_times = false;
+	int budget;
 	int i;
+	#if defined(CHIP8_PROFILE)
+	bool show_profile = false;
+	#endif
+
+	#if defined(PLATFORM_SDL2)
+	if (pschip8_emu_thread) {
+		run_game_threaded(gamepath);
+		return;
+	}
+	#endif
 
-	chip8_loadrom(gamepath);
-	chip8_reset();
+	open_game(g, gamepath);
+	load_ram_buffer(g->pixels, &pos, &size, DISPLAY_SCALE);
 
 	reset_timers();
+	frame_times_reset(&frame_times);
 	while (!sys_quit_flag) {
 		pad = get_paddata();
+		if (pressed(pad, pad_old, BUTTON_SELECT|BUTTON_CIRCLE))
+			show_times = !show_times;
+		#if defined(CHIP8_PROFILE)
+		if (pressed(pad, pad_old, BUTTON_SELECT|BUTTON_SQUARE)) {
+			show_profile = !show_profile;
+			if (show_profile)
+				dump_profile(g->vm);
+		}
+		#endif
+		pad_old = pad;
 
-		if (pad != pad_old) {
-			if ((pad&BUTTON_START) && (pad&BUTTON_SELECT))
-				break;
+		game_input(g, pad);
+		if (g->quit)
+			break;
+		frame_mark(&frame_times, PHASE_INPUT);
 
-			for (i = 0; i < sizeof(button_tbl)/sizeof(button_tbl[0]); ++i) {
-				if (pad&button_tbl[i])
-					chip8_keys |= 0x01<<i;
-				else
-					chip8_keys &= ~(0x01<<i);
-			}
+		timer = get_msec();
+		budget = (steps_per_frame + steps_leftouver) / 1000;
+		i = emulate_frame(g, pad, budget);
 
-			pad_old = pad;
+		/* a faulted guest doesn't owe the steps it can't run */
+		if (!g->rewinding && g->reason != CHIP8EXIT_ERROR) {
+			steps_cnt += i;
+			if (steps_leftouver >= 1000)
+				steps_leftouver -= 1000;
+			steps_leftouver += (steps_per_frame + steps_leftouver) - (i * 1000);
 		}
+		frame_mark(&frame_times, PHASE_EMULATE);
 
-		timer = get_msec();
-		for (i = 0; i < (steps_per_frame + steps_leftouver) / 1000; ++i) {
-			chip8_step();
-			++steps_cnt;
-		}
+		dirty = render_ahead(g, budget);
+		frame_mark(&frame_times, PHASE_AHEAD);
 
-		if (steps_leftouver >= 1000)
-			steps_leftouver -= 1000;
-		
-		steps_leftouver += (steps_per_frame + steps_leftouver) - (i * 1000);
+		if (show_times)
+			print_frame_times(&frame_times);
+		else
+			print_help(fps, steps, g->rw->frames, (g->rw->used + 1023u) / 1024u,
+			           g->ahead, frame_times.avg[PHASE_AHEAD]);
 
-		font_print(&(struct vec2){ 8, 8 },
-		           "Press START & SELECT to reset\n"
-		           "Frames per second: %d\n"
-		           "Steps per second: %d", varpack);
+		#if defined(CHIP8_PROFILE)
+		if (show_profile)
+			print_profile(g->vm);
+		#endif
+		frame_mark(&frame_times, PHASE_TEXT);
 
-		if (chip8_draw_flag)
-			load_ram_buffer(chip8_gfx, &pos, &size, 3);
+		if (dirty != 0)
+			upload_dirty_rows(g->pixels, dirty);
+		frame_mark(&frame_times, PHASE_UPLOAD);
 
 		draw_ram_buffer();
+		frame_mark(&frame_times, PHASE_DRAW);
+
 		update_display();
 
+		/* a vm waiting on Fx0A can't change anything, sleep until input
+		 * and let it idle through the time slept */
+		if (!g->rewinding && g->vm->state == CHIP8STATE_WAITKEY &&
+		    g->vm->keys == 0 && !input_pending(g)) {
+			slept = wait_input(100);
+			cycle = g->vm->cycles;
+			chip8_run(g->vm, movie_budget(g->mv, &g->mv_next, g->vm,
+			                            (slept * CHIP8_FREQ) / 1000u), NULL);
+			/* the change which woke it is due right away */
+			g->input_usec = get_usec_now();
+			play_beeps(g->vm, cycle, g->vm->cycles - cycle,
+			           g->input_usec, slept * 1000u);
+			last_sec += slept;
+		}
+		frame_mark(&frame_times, PHASE_PRESENT);
+		frame_end(&frame_times);
+
 		++fps_cnt;
 		if ((timer - last_sec) >= 1000u) {
 			steps = steps_cnt;
@@ -276,8 +1114,11 @@ static void run_game(const char* const gamepath)
 			steps_cnt = 0;
 			fps_cnt = 0;
 			last_sec = timer;
+			frame_stats(&frame_times);
 		}
 	}
+
+	close_game(g);
 }
 
 void pschip8()
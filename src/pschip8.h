@@ -2,6 +2,22 @@
 #define PSCHIP8_PSCHIP8_H_
 
 
+/* set by the host before pschip8(): when pschip8_movie_path is set
+ * every game started records its input to it, or replays it when
+ * pschip8_movie_replay is set
+ */
+extern const char* pschip8_movie_path;
+extern bool pschip8_movie_replay;
+/* frames every game shows ahead of the vm to hide the input lag of
+ * the roms, SELECT & R1 changes it while playing
+ */
+extern uint8_t pschip8_run_ahead;
+#if defined(PLATFORM_SDL2)
+/* runs the vm on its own thread, decoupled from the display's rate */
+extern bool pschip8_emu_thread;
+#endif
+
+
 void pschip8(void);
 
 
@@ -0,0 +1,242 @@
+#include <string.h>
+#include "rewind.h"
+
+
+#define STATE_SIZE   (sizeof(struct chip8_state))
+#define SCRATCH_SIZE (STATE_SIZE * 2)
+
+/* a delta record in the ring is the encoded length (2 bytes),
+ * the encoded delta and the length again so the ring can be
+ * walked from both ends
+ */
+#define RECORD_OVERHEAD (4)
+
+
+static uint32_t put_varint(uint8_t* const out, uint32_t value)
+{
+	uint32_t n = 0;
+	while (value >= 0x80) {
+		out[n++] = (value&0x7F)|0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+static uint32_t get_varint(const uint8_t* const in, uint32_t* const pos)
+{
+	uint32_t value = 0;
+	uint8_t shift = 0;
+	uint8_t byte;
+	do {
+		byte = in[(*pos)++];
+		value |= (uint32_t)(byte&0x7F) << shift;
+		shift += 7;
+	} while (byte&0x80);
+	return value;
+}
+
+/* encodes a ^ b as (zero run, literal run, literal bytes) triplets,
+ * zero runs shorter than 3 bytes are cheaper as literals and the
+ * trailing zero run is implicit
+ */
+static uint32_t encode_delta(uint8_t* const out,
+                             const uint8_t* const a,
+                             const uint8_t* const b,
+                             const uint32_t size)
+{
+	uint32_t o = 0;
+	uint32_t i = 0;
+	uint32_t zeros, lits, j;
+
+	while (i < size) {
+		zeros = i;
+		while ((i&0x03) != 0 && i < size && a[i] == b[i])
+			++i;
+		while (i + 4 <= size &&
+		       *(const uint32_t*)(a + i) == *(const uint32_t*)(b + i))
+			i += 4;
+		while (i < size && a[i] == b[i])
+			++i;
+		if (i == size)
+			break;
+
+		lits = i;
+		for (;;) {
+			while (i < size && a[i] != b[i])
+				++i;
+			for (j = i; j < size && j < i + 3 && a[j] == b[j]; ++j)
+				;
+			if (j == size || j == i + 3)
+				break;
+			i = j;
+		}
+
+		o += put_varint(out + o, lits - zeros);
+		o += put_varint(out + o, i - lits);
+		for (j = lits; j < i; ++j)
+			out[o++] = a[j] ^ b[j];
+	}
+
+	return o;
+}
+
+static void apply_delta(uint8_t* const dst,
+                        const uint8_t* const in,
+                        const uint32_t len)
+{
+	uint32_t pos = 0;
+	uint32_t i = 0;
+	uint32_t lits;
+
+	while (pos < len) {
+		i += get_varint(in, &pos);
+		lits = get_varint(in, &pos);
+		while (lits-- > 0)
+			dst[i++] ^= in[pos++];
+	}
+}
+
+static void ring_write(struct rewind* const rw,
+                       const uint8_t* const src,
+                       const uint32_t size)
+{
+	const uint32_t first = rw->capacity - rw->end;
+	if (size <= first) {
+		memcpy(rw->ring + rw->end, src, size);
+	} else {
+		memcpy(rw->ring + rw->end, src, first);
+		memcpy(rw->ring, src + first, size - first);
+	}
+	rw->end = (rw->end + size) % rw->capacity;
+	rw->used += size;
+}
+
+static void ring_read(const struct rewind* const rw,
+                      uint8_t* const dst,
+                      const uint32_t offset,
+                      const uint32_t size)
+{
+	const uint32_t first = rw->capacity - offset;
+	if (size <= first) {
+		memcpy(dst, rw->ring + offset, size);
+	} else {
+		memcpy(dst, rw->ring + offset, first);
+		memcpy(dst + first, rw->ring, size - first);
+	}
+}
+
+static uint32_t ring_read_len(const struct rewind* const rw,
+                              const uint32_t offset)
+{
+	uint8_t len[2];
+	ring_read(rw, len, offset, 2);
+	return len[0]|(len[1]<<8);
+}
+
+static void drop_oldest(struct rewind* const rw)
+{
+	const uint32_t size = ring_read_len(rw, rw->start) + RECORD_OVERHEAD;
+	rw->start = (rw->start + size) % rw->capacity;
+	rw->used -= size;
+	--rw->frames;
+}
+
+
+struct rewind* rewind_create(const uint32_t capacity)
+{
+	struct rewind* const rw = MALLOC(sizeof(struct rewind));
+	if (rw == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	rw->ring = MALLOC(capacity);
+	rw->scratch = MALLOC(SCRATCH_SIZE);
+	if (rw->ring == NULL || rw->scratch == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	rw->capacity = capacity;
+	rewind_clear(rw);
+	LOGINFO("Rewind buffer: %lu bytes",
+	        (unsigned long)rewind_memory(rw));
+	return rw;
+}
+
+void rewind_destroy(struct rewind* const rw)
+{
+	FREE(rw->scratch);
+	FREE(rw->ring);
+	FREE(rw);
+}
+
+void rewind_clear(struct rewind* const rw)
+{
+	rw->start = 0;
+	rw->end = 0;
+	rw->used = 0;
+	rw->frames = 0;
+	rw->has_head = false;
+}
+
+void rewind_push(struct rewind* const rw, const struct chip8* const ctx)
+{
+	uint32_t len;
+	uint8_t lenbuf[2];
+
+	if (!rw->has_head) {
+		chip8_save_state(ctx, &rw->head);
+		rw->has_head = true;
+		return;
+	}
+
+	chip8_save_state(ctx, &rw->cur);
+	len = encode_delta(rw->scratch, (const uint8_t*)&rw->cur,
+	                   (const uint8_t*)&rw->head, STATE_SIZE);
+	memcpy(&rw->head, &rw->cur, STATE_SIZE);
+
+	if (len + RECORD_OVERHEAD > rw->capacity) {
+		/* the chain back to the older snapshots is broken */
+		rw->start = rw->end = rw->used = rw->frames = 0;
+		return;
+	}
+
+	while (rw->capacity - rw->used < len + RECORD_OVERHEAD)
+		drop_oldest(rw);
+
+	lenbuf[0] = len&0xFF;
+	lenbuf[1] = len>>8;
+	ring_write(rw, lenbuf, 2);
+	ring_write(rw, rw->scratch, len);
+	ring_write(rw, lenbuf, 2);
+	++rw->frames;
+}
+
+bool rewind_pop(struct rewind* const rw, struct chip8* const ctx)
+{
+	uint32_t len, offset;
+
+	if (!rw->has_head)
+		return false;
+
+	if (rw->frames == 0) {
+		chip8_load_state(ctx, &rw->head);
+		return false;
+	}
+
+	offset = (rw->end + rw->capacity - 2) % rw->capacity;
+	len = ring_read_len(rw, offset);
+	offset = (offset + rw->capacity - len) % rw->capacity;
+	ring_read(rw, rw->scratch, offset, len);
+	apply_delta((uint8_t*)&rw->head, rw->scratch, len);
+
+	rw->end = (offset + rw->capacity - 2) % rw->capacity;
+	rw->used -= len + RECORD_OVERHEAD;
+	--rw->frames;
+
+	chip8_load_state(ctx, &rw->head);
+	return true;
+}
+
+uint32_t rewind_memory(const struct rewind* const rw)
+{
+	return sizeof(struct rewind) + rw->capacity + SCRATCH_SIZE;
+}
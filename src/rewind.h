@@ -0,0 +1,39 @@
+#ifndef PSCHIP8_REWIND_H_ /* PSCHIP8_REWIND_H_ */
+#define PSCHIP8_REWIND_H_
+#include "chip8.h"
+
+
+/* history of vm snapshots for stepping a game backwards.
+ * only the newest snapshot is kept whole, every older one is stored
+ * in a fixed size byte ring as the XOR of it and its successor,
+ * run length encoded. the oldest deltas are dropped when the ring is full
+ */
+struct rewind {
+	struct chip8_state head;    /* newest snapshot */
+	struct chip8_state cur;     /* scratch for the snapshot being pushed */
+	uint8_t* ring;
+	uint8_t* scratch;           /* one encoded delta */
+	uint32_t capacity;
+	uint32_t start;             /* offset of the oldest delta */
+	uint32_t end;               /* offset past the newest delta */
+	uint32_t used;              /* ring bytes in use */
+	uint32_t frames;            /* deltas in the ring */
+	bool has_head;
+};
+
+
+/* capacity is the size of the delta ring, the total memory
+ * used is reported by rewind_memory()
+ */
+struct rewind* rewind_create(uint32_t capacity);
+void rewind_destroy(struct rewind* rw);
+void rewind_clear(struct rewind* rw);
+void rewind_push(struct rewind* rw, const struct chip8* ctx);
+/* loads the previous snapshot into ctx, returns false when
+ * there's no history left, ctx is then reset to the oldest snapshot
+ */
+bool rewind_pop(struct rewind* rw, struct chip8* ctx);
+uint32_t rewind_memory(const struct rewind* rw);
+
+
+#endif /* PSCHIP8_REWIND_H_ */
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL_main.h>
 #include "system.h"
 #include "pschip8.h"
@@ -6,6 +7,28 @@
 
 int main(int argc, char** argv)
 {
+	for (int i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-p") == 0) &&
+		    i + 1 < argc) {
+			pschip8_movie_replay = argv[i][1] == 'p';
+			pschip8_movie_path = argv[++i];
+		} else if (strcmp(argv[i], "-t") == 0) {
+			pschip8_emu_thread = true;
+		} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			pschip8_run_ahead = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			sys_beeper_samples = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [-r record_movie | -p play_movie] [-t] [-a frames]\n"
+			                "          [-b samples]\n"
+			                "  -t runs the emulation on its own thread\n"
+			                "  -a shows the game that many frames ahead, up to 4\n"
+			                "  -b sets the beeper's audio buffer, 256 samples by default\n",
+			        argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	init_system();
 	const struct game_list* gamelist = open_game_list();
 	for (int i = 0; i < gamelist->size; ++i)
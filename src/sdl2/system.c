@@ -9,7 +9,13 @@
 bool sys_quit_flag = false;
 
 /* input */
+#define INPUT_QUEUE_SIZE (64) /* power of two */
 uint16_t sys_paddata;
+/* single producer single consumer ring, poll_events() being the producer */
+static struct input_event input_queue[INPUT_QUEUE_SIZE];
+static SDL_atomic_t input_head;
+static SDL_atomic_t input_tail;
+static button_t input_queued;   /* the pad of the newest change queued */
 
 /* timers */
 uint32_t sys_msec_timer;
@@ -24,9 +30,17 @@ static SDL_Texture* font_tex = NULL;
 static SDL_Texture* sprite_sheet_tex = NULL;
 static SDL_Texture* ram_buffer_tex = NULL;
 static SDL_Rect ram_buffer_rect;
+static struct vec2 ram_buffer_size;
 static struct vec2 char_csize;
 static struct vec2 char_tsize;
 static uint8_t char_ascii_index;
+/* textures and surfaces created, gameplay frames must not move it.
+ * the count is taken when a game loads its ram buffer and checked on
+ * every frame presented after that
+ */
+static uint32_t video_allocs;
+static uint32_t video_allocs_last;
+static bool video_allocs_checked;
 
 
 /* audio */
@@ -34,9 +48,55 @@ static Mix_Chunk** snds_chunks = NULL;
 static uint8_t* snds_chans = NULL;
 static short nsnds_chunks;
 
+/* beeper */
+#define BEEPER_RATE       (44100)
+#define BEEPER_TONE       (440)
+#define BEEPER_VOLUME     (0x0C00)
+#define BEEPER_QUEUE_SIZE (64) /* power of two */
+/* how long after its timestamp a change is heard. a frame's changes
+ * are published once it's emulated, up to a frame after they happened
+ */
+#define BEEPER_DELAY_USEC (20000u)
+
+struct beeper_change {
+	uint32_t usec;
+	bool on;
+};
+
+uint16_t sys_beeper_samples = 256;
+static SDL_AudioDeviceID beeper_dev;
+/* single producer single consumer ring, the audio callback being the consumer */
+static struct beeper_change beeper_queue[BEEPER_QUEUE_SIZE];
+static SDL_atomic_t beeper_head;
+static SDL_atomic_t beeper_tail;
+/* owned by the audio callback */
+static uint32_t beeper_base;      /* the timestamp played by the sample 0 */
+static uint64_t beeper_samples;   /* samples played since beeper_base */
+static uint16_t beeper_phase;
+static bool beeper_on;
+
+
+/* a change which doesn't fit is retried with the pad of the next poll */
+static void queue_input(const uint32_t usec, const button_t pad)
+{
+	const int head = SDL_AtomicGet(&input_head);
+
+	if (pad == input_queued ||
+	    head - SDL_AtomicGet(&input_tail) == INPUT_QUEUE_SIZE)
+		return;
+
+	input_queue[head&(INPUT_QUEUE_SIZE - 1)].usec = usec;
+	input_queue[head&(INPUT_QUEUE_SIZE - 1)].pad = pad;
+	SDL_AtomicSet(&input_head, head + 1);
+	input_queued = pad;
+}
 
 static void poll_events(void)
 {
+	/* the events carry the SDL_GetTicks() msec they were read from
+	 * the system at, rebased on the usec clock */
+	const uint32_t usec = get_usec_now();
+	const uint32_t ticks = SDL_GetTicks();
 	SDL_Event ev;
 	while (SDL_PollEvent(&ev)) {
 		if (ev.type == SDL_QUIT) {
@@ -66,7 +126,52 @@ static void poll_events(void)
 			sys_paddata |= button;
 		else
 			sys_paddata &= ~button;
+
+		const uint32_t age = ev.key.timestamp < ticks ? ticks - ev.key.timestamp : 0;
+		queue_input(usec - age * 1000u, sys_paddata);
 	}
+
+	queue_input(usec, sys_paddata);
+}
+
+/* plays the changes on the sample matching their timestamp. the
+ * timestamps follow the sample count, which is brought back in step
+ * with the host clock when the two drift apart
+ */
+static void beeper_callback(void* const userdata, Uint8* const stream, const int len)
+{
+	int16_t* const out = (int16_t*)stream;
+	const int nsamples = len / sizeof(int16_t);
+	const uint32_t target = get_usec_now() - BEEPER_DELAY_USEC;
+	const int head = SDL_AtomicGet(&beeper_head);
+	int tail = SDL_AtomicGet(&beeper_tail);
+	uint32_t clock = beeper_base + (beeper_samples * 1000000u) / BEEPER_RATE;
+	uint32_t usec;
+	int i;
+
+	if ((int32_t)(clock - target) > (int32_t)(BEEPER_DELAY_USEC / 2) ||
+	    (int32_t)(target - clock) > (int32_t)(BEEPER_DELAY_USEC / 2)) {
+		beeper_base = clock = target;
+		beeper_samples = 0;
+	}
+
+	for (i = 0; i < nsamples; ++i) {
+		usec = clock + ((uint64_t)i * 1000000u) / BEEPER_RATE;
+		while (tail != head &&
+		       (int32_t)(beeper_queue[tail&(BEEPER_QUEUE_SIZE - 1)].usec - usec) <= 0) {
+			beeper_on = beeper_queue[tail&(BEEPER_QUEUE_SIZE - 1)].on;
+			++tail;
+		}
+
+		beeper_phase += (BEEPER_TONE * 65536u) / BEEPER_RATE;
+		if (!beeper_on)
+			out[i] = 0;
+		else
+			out[i] = beeper_phase&0x8000 ? BEEPER_VOLUME : -BEEPER_VOLUME;
+	}
+
+	SDL_AtomicSet(&beeper_tail, tail);
+	beeper_samples += nsamples;
 }
 
 static void set_bmp_tex(const void* const data,
@@ -79,6 +184,7 @@ static void set_bmp_tex(const void* const data,
 		SDL_DestroyTexture(*texp);
 
 	SDL_Surface* const surf = SDL_LoadBMP_RW(SDL_RWFromConstMem(data, size), 1);
+	video_allocs += 2;
 
 	if (magic_pink) {
 		SDL_SetColorKey(surf, SDL_TRUE,
@@ -110,6 +216,10 @@ void init_system(void)
 	                              SDL_RENDERER_ACCELERATED|
 				      SDL_RENDERER_PRESENTVSYNC);
 
+	/* only the software one exists under the dummy video driver */
+	if (renderer == NULL)
+		renderer = SDL_CreateRenderer(window, -1, 0);
+
 	if (renderer == NULL)
 		FATALERROR("%s", SDL_GetError());
 
@@ -120,11 +230,31 @@ void init_system(void)
 
 	/* input */
 	sys_paddata = 0;
+	input_queued = 0;
+	flush_input_events();
 
 	/* audio */
 	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) != 0)
 		FATALERROR("%s", Mix_GetError());
 
+	/* the beeper gets a device of its own, with a buffer small enough
+	 * for the beeps to be heard as they're emulated */
+	{
+		const SDL_AudioSpec want = {
+			.freq = BEEPER_RATE,
+			.format = AUDIO_S16SYS,
+			.channels = 1,
+			.samples = sys_beeper_samples,
+			.callback = beeper_callback
+		};
+		SDL_AudioSpec have;
+		beeper_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+		if (beeper_dev == 0)
+			LOGERROR("No beeper: %s", SDL_GetError());
+		else
+			SDL_PauseAudioDevice(beeper_dev, 0);
+	}
+
 	/* timers */
 	reset_timers();
 	update_display();
@@ -142,8 +272,11 @@ void term_system(void)
 	SDL_DestroyTexture(bkg_tex);
 	SDL_DestroyTexture(font_tex);
 	SDL_DestroyTexture(sprite_sheet_tex);
+	SDL_DestroyTexture(ram_buffer_tex);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
+	if (beeper_dev != 0)
+		SDL_CloseAudioDevice(beeper_dev);
 	SDL_CloseAudio();
 	Mix_Quit();
 	SDL_Quit();
@@ -170,10 +303,60 @@ void update_display(void)
 	if (bkg_tex != NULL)
 		SDL_RenderCopy(renderer, bkg_tex, NULL, NULL);
 
+	if (video_allocs_checked && video_allocs != video_allocs_last) {
+		LOGERROR("%u video allocations in the last gameplay frame",
+		         video_allocs - video_allocs_last);
+		video_allocs_last = video_allocs;
+	}
+
 	poll_events();
 	update_timers();
 }
 
+bool pop_input_event(struct input_event* const ev)
+{
+	const int tail = SDL_AtomicGet(&input_tail);
+
+	if (tail == SDL_AtomicGet(&input_head))
+		return false;
+
+	*ev = input_queue[tail&(INPUT_QUEUE_SIZE - 1)];
+	SDL_AtomicSet(&input_tail, tail + 1);
+	return true;
+}
+
+void flush_input_events(void)
+{
+	SDL_AtomicSet(&input_tail, SDL_AtomicGet(&input_head));
+}
+
+/* a change which doesn't fit is dropped, the audio callback
+ * drains the queue long before that
+ */
+void set_beeper(const bool on, const uint32_t usec)
+{
+	const int head = SDL_AtomicGet(&beeper_head);
+
+	if (beeper_dev == 0 ||
+	    head - SDL_AtomicGet(&beeper_tail) == BEEPER_QUEUE_SIZE)
+		return;
+
+	beeper_queue[head&(BEEPER_QUEUE_SIZE - 1)].usec = usec;
+	beeper_queue[head&(BEEPER_QUEUE_SIZE - 1)].on = on;
+	SDL_AtomicSet(&beeper_head, head + 1);
+}
+
+uint32_t wait_input(const uint32_t timeout)
+{
+	const uint32_t start = SDL_GetTicks();
+
+	SDL_WaitEventTimeout(NULL, timeout);
+	poll_events();
+	update_timers();
+
+	return SDL_GetTicks() - start;
+}
+
 void font_print(const struct vec2* const pos,
                 const char* const fmt,
                 const void* const* varpack)
@@ -252,6 +435,22 @@ void draw_ram_buffer(void)
 	SDL_RenderCopy(renderer, ram_buffer_tex, NULL, &ram_buffer_rect);
 }
 
+void draw_bars(const struct vec2* const pos,
+               const uint8_t* const heights,
+               const short nbars)
+{
+	SDL_Rect bar = { pos->x, 0, 1, 0 };
+
+	SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+	for (short i = 0; i < nbars; ++i, ++bar.x) {
+		bar.y = pos->y - heights[i];
+		bar.h = heights[i];
+		SDL_RenderFillRect(renderer, &bar);
+	}
+	/* update_display() clears with it */
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+}
+
 void assign_snd_chan(const uint8_t chan, const uint8_t snd_index)
 {
 	snds_chans[chan] = snd_index;
@@ -304,17 +503,14 @@ void load_snd(void* const* const snds, const short nsnds)
 		snds_chunks[i] = Mix_QuickLoad_WAV(snds[i]);
 }
 
+/* the streaming texture is kept for as long as the size doesn't change,
+ * so loading a new buffer of the same size only copies pixels
+ */
 void load_ram_buffer(void* const pixels,
                      const struct vec2* const pos,
                      const struct vec2* const size,
                      const uint8_t scale)
 {
-	SDL_Surface* const surf =
-		SDL_CreateRGBSurfaceWithFormatFrom(
-                  pixels, size->x, size->y,
-                  16, size->x * sizeof(uint16_t),
-	          SDL_PIXELFORMAT_ARGB1555);
-
 	ram_buffer_rect = (SDL_Rect) {
 		.x = pos->x - ((size->x * scale) / 2),
 		.y = pos->y - ((size->y * scale) / 2),
@@ -322,12 +518,48 @@ void load_ram_buffer(void* const pixels,
 		.h = size->y * scale
 	};
 
-	if (ram_buffer_tex != NULL)
-		SDL_DestroyTexture(ram_buffer_tex);
+	if (ram_buffer_tex == NULL ||
+	    ram_buffer_size.x != size->x || ram_buffer_size.y != size->y) {
+		if (ram_buffer_tex != NULL)
+			SDL_DestroyTexture(ram_buffer_tex);
 
-	ram_buffer_tex = SDL_CreateTextureFromSurface(renderer, surf);
+		ram_buffer_tex = SDL_CreateTexture(renderer,
+		                                   SDL_PIXELFORMAT_ARGB1555,
+		                                   SDL_TEXTUREACCESS_STREAMING,
+		                                   size->x, size->y);
+		if (ram_buffer_tex == NULL)
+			FATALERROR("%s", SDL_GetError());
 
-	SDL_FreeSurface(surf);
+		ram_buffer_size = *size;
+		++video_allocs;
+	}
+
+	load_ram_buffer_rows(pixels, 0, size->y);
+	video_allocs_last = video_allocs;
+	video_allocs_checked = true;
+}
+
+void load_ram_buffer_rows(const void* const pixels,
+                          const short row, const short nrows)
+{
+	const int pitch = ram_buffer_size.x * sizeof(uint16_t);
+	const SDL_Rect rect = { 0, row, ram_buffer_size.x, nrows };
+	const uint8_t* src = ((const uint8_t*)pixels) + (row * pitch);
+	uint8_t* dst;
+	int dst_pitch;
+
+	if (SDL_LockTexture(ram_buffer_tex, &rect, (void**)&dst, &dst_pitch) != 0) {
+		SDL_UpdateTexture(ram_buffer_tex, &rect, src, pitch);
+		return;
+	}
+
+	for (short i = 0; i < nrows; ++i) {
+		memcpy(dst, src, pitch);
+		dst += dst_pitch;
+		src += pitch;
+	}
+
+	SDL_UnlockTexture(ram_buffer_tex);
 }
 
 void load_files(const char* const* const filenames,
@@ -355,6 +587,35 @@ void load_files(const char* const* const filenames,
 	}
 }
 
+void* read_file(const char* const path, uint32_t* const size)
+{
+	FILE* const file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	const long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	void* const data = MALLOC(len > 0 ? len : 1);
+	if (data == NULL)
+		FATALERROR("Couldn't allocate memory!");
+
+	*size = fread(data, 1, len, file);
+	fclose(file);
+	return data;
+}
+
+bool write_file(const char* const path, const void* const data, const uint32_t size)
+{
+	FILE* const file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+
+	const bool ok = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && ok;
+}
+
 const struct game_list* open_game_list(void)
 {
 	DIR* const dir = opendir("data/");
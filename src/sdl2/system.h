@@ -11,6 +11,7 @@
 #define uint8_t  Uint8
 #define uint16_t Uint16
 #define uint32_t Uint32
+#define uint64_t Uint64
 #define int8_t   Sint8
 #define int16_t  Sint16
 #define int32_t  Sint32
@@ -71,6 +72,12 @@ enum Button {
 };
 
 
+/* a change of the pad, stamped with the get_usec_now() time it happened */
+struct input_event {
+	uint32_t usec;
+	button_t pad;    /* the whole pad after the change */
+};
+
 struct vec2 {
 	int16_t x, y;
 };
@@ -92,9 +99,24 @@ void term_system(void);
 void reset_timers(void);
 void update_timers(void);
 void update_display(void);
+/* the pad changes are queued as they're read, pop_input_event() takes
+ * the oldest one and returns false when there's none. one thread only
+ * may take them, flush_input_events() drops those not taken yet
+ */
+bool pop_input_event(struct input_event* ev);
+void flush_input_events(void);
+/* the chip8 buzzer, a square wave turned on or off as of the
+ * get_usec_now() time given, and heard a fixed delay later. one
+ * thread only may set it
+ */
+void set_beeper(bool on, uint32_t usec);
+/* sleeps until an input event or the timeout, returns the msecs slept */
+uint32_t wait_input(uint32_t timeout);
 void font_print(const struct vec2* pos, const char* fmt, const void* const* varpack);
 void draw_sprites(const struct sprite* sprites, short nsprites);
 void draw_ram_buffer(void);
+/* one pixel wide bars standing on pos, left to right */
+void draw_bars(const struct vec2* pos, const uint8_t* heights, short nbars);
 void assign_snd_chan(uint8_t chan, uint8_t snd_index);
 void enable_chan(uint8_t chan);
 void load_sprite_sheet(const void* data, short max_sprites_on_screen);
@@ -104,13 +126,26 @@ void load_font(const void* data, const struct vec2* charsize,
 void load_snd(void* const* snds, short nsnds);
 void load_ram_buffer(void* pixels, const struct vec2* pos,
                      const struct vec2* size, uint8_t scale);
+/* updates rows [row, row + nrows) of the loaded ram buffer,
+ * pixels points to the whole buffer
+ */
+void load_ram_buffer_rows(const void* pixels, short row, short nrows);
 void load_files(const char* const* filenames, void** dsts, short nfiles);
+/* whole file io outside data/, read_file returns a MALLOC'd
+ * buffer or NULL when the file can't be read
+ */
+void* read_file(const char* path, uint32_t* size);
+bool write_file(const char* path, const void* data, uint32_t size);
 const struct game_list* open_game_list(void);
 void close_game_list(const struct game_list* gamelist);
 void sys_log(const char* cat, const char* fmt, ...);
 void sys_fatalerror(const char* fmt, ...);
 
 
+/* the beeper's audio buffer in samples, set before init_system() */
+extern uint16_t sys_beeper_samples;
+
+
 static inline void load_sync(void)
 {
 	const uint32_t ticks = SDL_GetTicks();
@@ -137,6 +172,19 @@ static inline uint32_t get_msec_now(void)
 	return sys_msec_timer;
 }
 
+/* nanoseconds from the performance counter */
+static inline uint64_t get_nsec_now(void)
+{
+	const uint64_t count = SDL_GetPerformanceCounter();
+	const uint64_t freq = SDL_GetPerformanceFrequency();
+	return (count / freq) * 1000000000u + ((count % freq) * 1000000000u) / freq;
+}
+
+static inline uint32_t get_usec_now(void)
+{
+	return get_nsec_now() / 1000u;
+}
+
 
 
 